@@ -0,0 +1,217 @@
+#include "ffm-model-kernels.h"
+
+#include "util/nn-helpers.h"
+#include "util/alloc.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+// Microbenchmark of fused multiply-adds in update kernels: times avx2 kernels with fma and with
+// multiply-adds split into separate operations. Compiled without implicit contraction (see Makefile),
+// so split version really uses separate instructions.
+//
+// Also compares dense layers of nn models run example by example and as matrix products over mini-batch,
+// and int8 row dot products of inference models without and with vnni instructions.
+
+constexpr uint n_rows = 4096; // Rows are kept in L2 cache, so arithmetic dominates
+constexpr uint n_pairs = 1 << 16;
+constexpr uint n_rounds = 50;
+
+
+struct simd_avx2_split : simd_avx2 {
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+    static vec fnmadd(vec a, vec b, vec c) { return _mm256_sub_ps(c, _mm256_mul_ps(a, b)); }
+};
+
+
+template <typename F>
+double time_ns(uint n_ops, F f) {
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint r = 0; r < n_rounds; ++ r)
+        f();
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count() / n_rounds / n_ops;
+}
+
+
+// Time update of interaction rows pairs with optimizer O
+template <typename V, typename O>
+double bench_ffm_update(const uint32_t * pairs) {
+    float * weights = malloc_aligned<float>(n_rows * O::field_stride);
+    xoshiro256x4 gen(1);
+
+    for (uint i = 0; i < n_rows * O::field_stride; ++ i)
+        weights[i] = O::initial_state(i % O::field_stride) + 0.01f * (i % 7);
+
+    typename V::vec v_kappa_val = V::set1(0.01f), v_lambda = V::set1(0.00002f), v_eta = V::set1(0.2f);
+
+    double res = time_ns(n_pairs, [&]() {
+        for (uint p = 0; p < n_pairs; ++ p) {
+            float * wa = weights + (pairs[p] % n_rows) * O::field_stride;
+            float * wb = weights + (pairs[p] / n_rows) * O::field_stride;
+
+            O::template update<V, ffm_fp32_weights>(wa, wb, v_kappa_val, v_lambda, v_eta, gen);
+        }
+    });
+
+    free_aligned(weights);
+
+    return res;
+}
+
+
+// Time int8 dot products of interaction rows pairs by function dot
+template <typename F>
+double bench_dot_int8(const uint32_t * pairs, uint n_dim, F dot) {
+    uint stride = (n_dim + 15) / 16 * 16;
+    int8_t * rows = malloc_aligned<int8_t>(n_rows * stride);
+
+    for (uint i = 0; i < n_rows * stride; ++ i)
+        rows[i] = int8_t(int(i * 37 % 255) - 127);
+
+    int32_t total = 0;
+
+    double res = time_ns(n_pairs, [&]() {
+        for (uint p = 0; p < n_pairs; ++ p)
+            total += dot(rows + (pairs[p] % n_rows) * stride, rows + (pairs[p] / n_rows) * stride, n_dim);
+    });
+
+    free_aligned(rows);
+
+    if (total == 1) // Keep products from being optimized out
+        std::cout << std::endl;
+
+    return res;
+}
+
+
+// Time backward pass of dense layer with given input size per output unit
+template <typename V>
+double bench_backward_pass(uint input_size, uint output_size) {
+    float * input = malloc_aligned<float>(input_size);
+    float * input_grad = malloc_aligned<float>(input_size);
+    float * w = malloc_aligned<float>(input_size * output_size);
+    float * wg = malloc_aligned<float>(input_size * output_size);
+
+    fill_with_rand_uniform(input, input_size, 0, 1, 1);
+    fill_with_zero(input_grad, input_size);
+    fill_with_rand_normal(w, input_size * output_size, 0, 0.1, 2);
+    fill_with_ones(wg, input_size * output_size);
+
+    double res = time_ns(output_size * 100, [&]() {
+        for (uint k = 0; k < 100; ++ k)
+            for (uint j = 0; j < output_size; ++ j)
+                backward_pass<V>(input_size, input, input_grad, w + j * input_size, wg + j * input_size, 0.001f, 0.02f, 0.00002f);
+    });
+
+    free_aligned(input);
+    free_aligned(input_grad);
+    free_aligned(w);
+    free_aligned(wg);
+
+    return res;
+}
+
+
+// Time forward and backward passes of dense layer over mini-batch of examples, one by one or batched, per example
+template <typename V>
+std::pair<double, double> bench_dense_layer(uint input_size, uint output_size) {
+    float * input = malloc_aligned<float>(mini_batch_size * input_size);
+    float * input_grad = malloc_aligned<float>(mini_batch_size * input_size);
+    float * output = malloc_aligned<float>(mini_batch_size * output_size);
+    float * grad = malloc_aligned<float>(mini_batch_size * output_size);
+    float * w = malloc_aligned<float>(input_size * output_size);
+    float * wg = malloc_aligned<float>(input_size * output_size);
+
+    fill_with_rand_uniform(input, mini_batch_size * input_size, 0, 1, 1);
+    fill_with_rand_normal(grad, mini_batch_size * output_size, 0, 0.01, 3);
+    fill_with_rand_normal(w, input_size * output_size, 0, 0.1, 2);
+    fill_with_ones(wg, input_size * output_size);
+
+    double single = time_ns(mini_batch_size * 100, [&]() {
+        for (uint k = 0; k < 100; ++ k) {
+            for (uint i = 0; i < mini_batch_size; ++ i) {
+                for (uint j = 0; j < output_size; ++ j)
+                    output[i * output_size + j] = forward_pass<V>(input_size, input + i * input_size, w + j * input_size);
+
+                fill_with_zero(input_grad + i * input_size, input_size);
+
+                for (uint j = 0; j < output_size; ++ j)
+                    backward_pass<V>(input_size, input + i * input_size, input_grad + i * input_size, w + j * input_size, wg + j * input_size, grad[i * output_size + j], 0.001f, 0.00002f);
+            }
+        }
+    });
+
+    double batched = time_ns(mini_batch_size * 100, [&]() {
+        for (uint k = 0; k < 100; ++ k) {
+            forward_pass_batch<V>(mini_batch_size, input_size, input, output_size, w, output, output_size);
+
+            fill_with_zero(input_grad, mini_batch_size * input_size);
+            backward_pass_batch<V>(mini_batch_size, input_size, input, input_grad, output_size, grad, output_size, w, wg, 0.001f, 0.00002f);
+        }
+    });
+
+    free_aligned(input);
+    free_aligned(input_grad);
+    free_aligned(output);
+    free_aligned(grad);
+    free_aligned(w);
+    free_aligned(wg);
+
+    return std::make_pair(single, batched);
+}
+
+
+void report(const std::string & name, double split_ns, double fused_ns) {
+    std::cout << std::setw(28) << std::left << name << std::right << std::fixed << std::setprecision(2)
+        << std::setw(10) << split_ns << std::setw(10) << fused_ns << std::setw(9) << split_ns / fused_ns << "x" << std::endl;
+}
+
+
+int main() {
+    if (detect_simd_isa() < simd_isa::avx2) {
+        std::cerr << "Cpu doesn't support avx2 and fma" << std::endl;
+        return 1;
+    }
+
+    uint32_t * pairs = malloc_aligned<uint32_t>(n_pairs);
+    xoshiro256 gen(2017);
+
+    for (uint p = 0; p < n_pairs; ++ p)
+        pairs[p] = gen() % (n_rows * n_rows);
+
+    std::cout << std::setw(28) << std::left << "kernel, ns per call" << std::right << std::setw(10) << "split" << std::setw(10) << "fma" << std::setw(10) << "gain" << std::endl;
+
+    report("ffm adagrad, dim 14", bench_ffm_update<simd_avx2_split, ffm_adagrad<ffm_dim<14>>>(pairs), bench_ffm_update<simd_avx2, ffm_adagrad<ffm_dim<14>>>(pairs));
+    report("ffm adagrad, dim 32", bench_ffm_update<simd_avx2_split, ffm_adagrad<ffm_dim<32>>>(pairs), bench_ffm_update<simd_avx2, ffm_adagrad<ffm_dim<32>>>(pairs));
+    report("ffm row-adagrad, dim 14", bench_ffm_update<simd_avx2_split, ffm_row_adagrad<ffm_dim<14>>>(pairs), bench_ffm_update<simd_avx2, ffm_row_adagrad<ffm_dim<14>>>(pairs));
+    report("backward pass, 96 inputs", bench_backward_pass<simd_avx2_split>(96, 64), bench_backward_pass<simd_avx2>(96, 64));
+    report("backward pass, 64 inputs", bench_backward_pass<simd_avx2_split>(64, 48), bench_backward_pass<simd_avx2>(64, 48));
+
+    std::cout << std::endl << std::setw(28) << std::left << "dense layer, ns per example" << std::right << std::setw(10) << "single" << std::setw(10) << "batched" << std::setw(10) << "gain" << std::endl;
+
+    auto l1 = bench_dense_layer<simd_avx2>(96, 63);
+    auto l2 = bench_dense_layer<simd_avx2>(64, 47);
+    auto ffm_nn_l1 = bench_dense_layer<simd_avx2>(16, 23);
+
+    report("nn layer 1, 96 x 63", l1.first, l1.second);
+    report("nn layer 2, 64 x 47", l2.first, l2.second);
+    report("ffm-nn layer 1, 16 x 23", ffm_nn_l1.first, ffm_nn_l1.second);
+
+    if (detect_int8_dot_isa() != int8_dot_isa::base) {
+        auto vnni = detect_int8_dot_isa() == int8_dot_isa::avx512vnni ? dot_int8_avx512vnni : dot_int8_avxvnni;
+
+        std::cout << std::endl << std::setw(28) << std::left << "int8 dot, ns per call" << std::right << std::setw(10) << "base" << std::setw(10) << "vnni" << std::setw(10) << "gain" << std::endl;
+
+        report("int8 dot, dim 14", bench_dot_int8(pairs, 14, dot_int8_base), bench_dot_int8(pairs, 14, vnni));
+        report("int8 dot, dim 32", bench_dot_int8(pairs, 32, dot_int8_base), bench_dot_int8(pairs, 32, vnni));
+    }
+
+    free_aligned(pairs);
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+import argparse
+import re
+import subprocess
+import time
+
+
+parser = argparse.ArgumentParser(description='Compare throughput and validation MAP of ffm optimizers')
+parser.add_argument('--model', type=str, default='ffm', help='Model name: ffm or ffm-nn')
+parser.add_argument('--train', type=str, required=True, help='Train dataset')
+parser.add_argument('--val', type=str, required=True, help='Validation dataset')
+parser.add_argument('--epochs', type=int, default=3, help='Number of epochs')
+parser.add_argument('--threads', type=int, default=4, help='Number of threads')
+parser.add_argument('--optimizers', type=str, default='adagrad,row-adagrad', help='Comma-separated optimizers to compare')
+parser.add_argument('--options', type=str, default='', help='Extra bin/ffm options')
+
+args = parser.parse_args()
+
+
+results = []
+
+for optimizer in args.optimizers.split(','):
+    cmd = "bin/ffm --model %s --optimizer %s --train %s --val %s --epochs %d --threads %d %s" % (args.model, optimizer, args.train, args.val, args.epochs, args.threads, args.options)
+
+    print("Running %s..." % cmd)
+
+    start_time = time.time()
+    output = subprocess.check_output(cmd, shell=True).decode()
+    elapsed = time.time() - start_time
+
+    train_examples = sum(int(n) for n in re.findall(r'Training\.\.\. (\d+) examples', output))
+    val_examples = sum(int(n) for n in re.findall(r'Evaluating\.\.\. (\d+) examples', output))
+    maps = [float(m) for m in re.findall(r'map = ([\d.]+)', output)]
+
+    results.append((optimizer, (train_examples + val_examples) / elapsed, maps[-1], max(maps)))
+
+print("")
+print("%-12s %16s %10s %10s" % ("optimizer", "examples/sec", "last map", "best map"))
+
+for optimizer, throughput, last_map, best_map in results:
+    print("%-12s %16.0f %10.5f %10.5f" % (optimizer, throughput, last_map, best_map))
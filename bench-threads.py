@@ -0,0 +1,59 @@
+import argparse
+import re
+import subprocess
+import time
+
+
+# Training modes and their bin/ffm options
+modes = {
+    'shared': '',
+    'replicas': '--dense-replicas',
+    'aggregated': '--aggregate-updates',
+    'sharded': '--shard-updates',
+}
+
+default_modes = {
+    'nn': 'shared,replicas',
+    'ffm-nn': 'shared,replicas',
+    'ffm': 'shared,aggregated,sharded',
+    'ftrl': 'shared,aggregated',
+}
+
+parser = argparse.ArgumentParser(description='Compare training throughput and validation MAP of models by number of threads and training mode: shared weights updated by all threads (hogwild), per-thread dense layers, updates aggregated over mini-batches or sharded between owner threads')
+parser.add_argument('--model', type=str, default='ffm-nn', help='Model name: nn, ffm-nn, ffm or ftrl')
+parser.add_argument('--train', type=str, required=True, help='Train dataset')
+parser.add_argument('--val', type=str, required=True, help='Validation dataset')
+parser.add_argument('--epochs', type=int, default=1, help='Number of epochs')
+parser.add_argument('--threads', type=str, default='1,2,4,8', help='Comma-separated numbers of threads to compare')
+parser.add_argument('--modes', type=str, help='Comma-separated training modes to compare: %s (default depends on model)' % ', '.join(modes))
+parser.add_argument('--options', type=str, default='', help='Extra bin/ffm options')
+
+args = parser.parse_args()
+
+mode_names = (args.modes or default_modes[args.model]).split(',')
+
+
+results = []
+
+for threads in [int(t) for t in args.threads.split(',')]:
+    for mode in mode_names:
+        mode_options = modes[mode]
+        cmd = "bin/ffm --model %s --train %s --val %s --epochs %d --threads %d %s %s" % (args.model, args.train, args.val, args.epochs, threads, mode_options, args.options)
+
+        print("Running %s..." % cmd)
+
+        start_time = time.time()
+        output = subprocess.check_output(cmd, shell=True).decode()
+        elapsed = time.time() - start_time
+
+        train_examples = sum(int(n) for n in re.findall(r'Training\.\.\. (\d+) examples', output))
+        val_examples = sum(int(n) for n in re.findall(r'Evaluating\.\.\. (\d+) examples', output))
+        maps = [float(m) for m in re.findall(r'map = ([\d.]+)', output)]
+
+        results.append((threads, mode, (train_examples + val_examples) / elapsed, maps[-1]))
+
+print("")
+print("%-8s %-10s %16s %10s" % ("threads", "mode", "examples/sec", "last map"))
+
+for threads, mode, throughput, last_map in results:
+    print("%-8d %-10s %16.0f %10.5f" % (threads, mode, throughput, last_map))
@@ -0,0 +1,384 @@
+#include "ffm-model.h"
+#include "ffm-nn-model.h"
+#include "ftrl-model.h"
+#include "nn-model.h"
+
+#include "util/update-shards.h"
+#include "util/random.h"
+#include "util/simd.h"
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <cmath>
+
+// Check that model kernels of each instruction set supported by cpu agree with scalar ones: every model is trained
+// and evaluated on the same fixed examples with kernels of each instruction set, and its predictions are compared.
+// Approximate reciprocal square roots of vector kernels make results differ slightly, so they are compared with tolerance
+
+constexpr uint n_fields = 8;
+constexpr uint n_train = 256;
+constexpr uint n_test = 64;
+constexpr uint group_size = 4; // Test examples of group share leading event features
+constexpr uint dropout_mask_size = 256; // In 64-bit words
+
+constexpr float tolerance = 1e-3; // Of predictions, relative to max(1, |prediction|)
+constexpr float sharded_tolerance = 0.01; // Of change of predictions by sharded training, which applies updates in different order
+
+
+struct check_example {
+    std::vector<ffm_feature> features;
+    ffm_float norm;
+    ffm_float y;
+    std::vector<uint64_t> dropout_mask;
+};
+
+
+ffm_feature random_feature(xoshiro256 & gen, uint field) {
+    ffm_feature f;
+    f.index = (field << ffm_hash_bits) | (gen() & ffm_hash_mask);
+    f.value = 0.5f + (gen() % 1000) / 1000.0f;
+    return f;
+}
+
+
+// Examples with event features of fields below n_fields / 2 shared by each group, and ad features of the rest
+std::vector<check_example> generate_examples(uint n, uint64_t seed) {
+    xoshiro256 gen(seed);
+    std::vector<check_example> res(n);
+    std::vector<ffm_feature> event;
+
+    for (uint i = 0; i < n; ++ i) {
+        if (i % group_size == 0) {
+            event.clear();
+
+            for (uint field = 0; field < n_fields / 2; ++ field)
+                for (uint k = 0, cnt = 1 + gen() % 3; k < cnt; ++ k)
+                    event.push_back(random_feature(gen, field));
+        }
+
+        check_example & ex = res[i];
+
+        ex.features = event;
+
+        for (uint field = n_fields / 2; field < n_fields; ++ field)
+            for (uint k = 0, cnt = gen() % 3; k < cnt; ++ k)
+                ex.features.push_back(random_feature(gen, field));
+
+        ex.norm = 0;
+        for (auto f = ex.features.begin(); f != ex.features.end(); ++ f)
+            ex.norm += f->value * f->value;
+
+        ex.y = gen() % 3 == 0 ? 1 : -1;
+
+        // Random dropout with probability 1/4
+        ex.dropout_mask.resize(dropout_mask_size);
+        for (uint w = 0; w < dropout_mask_size; ++ w)
+            ex.dropout_mask[w] = gen() | gen();
+    }
+
+    return res;
+}
+
+
+// Predictions made in training with dropout and then on test examples, by model trained with given instruction set
+template <typename M>
+std::vector<float> run_model(std::function<M*()> create_model, simd_isa isa, const std::vector<check_example> & train, const std::vector<check_example> & test, bool group_test) {
+    simd_kernels() = isa;
+
+    M * model = create_model();
+    std::vector<float> res;
+
+    for (uint i = 0; i < train.size(); ++ i) {
+        const check_example & ex = train[i];
+        const ffm_feature * start = ex.features.data(), * end = start + ex.features.size();
+        uint64_t * mask = const_cast<uint64_t *>(ex.dropout_mask.data());
+
+        if (model->get_dropout_mask_size(start, end) > dropout_mask_size * 64)
+            throw std::logic_error("Dropout mask is too small");
+
+        float t = model->predict(start, end, ex.norm, mask, 4.0f / 3);
+        float expnyt = exp(-ex.y * t);
+
+        model->update(start, end, ex.norm, -ex.y * expnyt / (1 + expnyt), mask, 4.0f / 3);
+
+        if (i % mini_batch_size == mini_batch_size - 1)
+            model->merge_thread_updates();
+
+        res.push_back(t);
+    }
+
+    model->merge_thread_updates();
+
+    std::vector<uint64_t> ones(dropout_mask_size, ~uint64_t(0));
+
+    for (uint i = 0; i < test.size(); ++ i)
+        res.push_back(model->predict(test[i].features.data(), test[i].features.data() + test[i].features.size(), test[i].norm, ones.data(), 1));
+
+    if (group_test) {
+        for (uint i = 0; i < test.size(); i += group_size) {
+            ffm_batch_example examples[group_size];
+            float predictions[group_size];
+
+            for (uint k = 0; k < group_size; ++ k) {
+                examples[k].start = test[i + k].features.data();
+                examples[k].end = examples[k].start + test[i + k].features.size();
+                examples[k].norm = test[i + k].norm;
+                examples[k].dropout_mask = ones.data();
+            }
+
+            model->predict_group(examples, group_size, 1, predictions);
+            res.insert(res.end(), predictions, predictions + group_size);
+        }
+    }
+
+    delete model;
+
+    return res;
+}
+
+
+// Compare predictions of model with each supported instruction set to scalar ones, returns number of failures
+template <typename M>
+uint check_model(const std::string & name, std::function<M*()> create_model, bool group_test = false) {
+    auto train = generate_examples(n_train, 1);
+    auto test = generate_examples(n_test, 2);
+
+    auto ref = run_model<M>(create_model, simd_isa::scalar, train, test, group_test);
+
+    // Group predictions are compared to per-example scalar ones
+    if (group_test)
+        std::copy(ref.end() - 2 * n_test, ref.end() - n_test, ref.end() - n_test);
+
+    uint failures = 0;
+
+    // Scalar kernels are run again to check their group predictions
+    for (simd_isa isa = group_test ? simd_isa::scalar : simd_isa::avx2; isa <= detect_simd_isa(); isa = simd_isa(int(isa) + 1)) {
+        auto res = run_model<M>(create_model, isa, train, test, group_test);
+
+        float max_err = 0;
+        bool ok = true;
+
+        for (uint i = 0; i < ref.size(); ++ i) {
+            float err = std::abs(res[i] - ref[i]) / std::max(1.0f, std::abs(ref[i]));
+
+            if (!(err <= tolerance)) // Including NaN
+                ok = false;
+
+            max_err = std::max(max_err, err);
+        }
+
+        std::cout << std::setw(36) << std::left << name << std::setw(8) << simd_isa_name(isa) << std::right
+            << "max error " << std::scientific << std::setprecision(2) << max_err << (ok ? "  ok" : "  FAILED") << std::endl;
+
+        if (!ok)
+            failures ++;
+    }
+
+    return failures;
+}
+
+
+// Sharded updates should pass whole aligned gradient rows, as owner applies them with full vectors
+uint check_update_shards() {
+    const uint row_size = 15, aligned_row_size = aligned_float_array_size(row_size);
+
+    omp_set_num_threads(2);
+    update_shards shards(10, row_size);
+    omp_set_num_threads(1);
+
+    float * grad = malloc_aligned<float>(aligned_row_size);
+
+    for (uint d = 0; d < aligned_row_size; ++ d)
+        grad[d] = d + 1;
+
+    uint failures = 0, received = 0;
+
+    // Enough records to reuse each slot of queue
+    for (uint r = 0; r < 3 * update_shards::sender_capacity; ++ r) {
+        shards.send(0, 1, r, 1, grad, [&]() {});
+
+        shards.receive(1, [&](uint64_t key, uint hits, const float * g) {
+            for (uint d = 0; d < aligned_row_size; ++ d)
+                if (g[d] != grad[d])
+                    failures ++;
+
+            if (key != received ++ || hits != 1)
+                failures ++;
+        });
+    }
+
+    free_aligned(grad);
+
+    bool ok = failures == 0 && received == 3 * update_shards::sender_capacity;
+
+    std::cout << std::setw(44) << std::left << "update shards, padded rows" << (ok ? "ok" : "FAILED") << std::endl;
+
+    return ok ? 0 : 1;
+}
+
+
+// Threads sending many more rows to each other than their queues hold should all finish, with every row received
+// by its owner exactly once
+uint check_update_shards_threads() {
+    const uint n_threads = 4, index_bits = 16, row_size = 15, n_rows = 8 * update_shards::sender_capacity;
+
+    omp_set_num_threads(n_threads);
+    update_shards shards(index_bits, row_size);
+    omp_set_num_threads(1);
+
+    // Row r of each sender has feature index spread over hash space, its key identifies sender too
+    auto row_index = [&](uint64_t r) { return (r * 40503) & ((1 << index_bits) - 1); };
+
+    std::vector<uint> received(n_threads * n_rows, 0);
+    std::atomic<uint> failures(0);
+
+    #pragma omp parallel num_threads(n_threads)
+    {
+        uint thread = omp_get_thread_num();
+        std::vector<float> grad(aligned_float_array_size(row_size), 0);
+
+        auto receive_own = [&]() {
+            shards.receive(thread, [&](uint64_t key, uint hits, const float * g) {
+                if (shards.owner(row_index(key % n_rows)) != thread || hits != 1 || g[0] != float(key % n_rows))
+                    failures ++;
+
+                received[key] ++;
+            });
+        };
+
+        for (uint r = 0; r < n_rows; ++ r) {
+            uint owner = shards.owner(row_index(r));
+
+            grad[0] = r;
+
+            if (owner == thread)
+                received[thread * n_rows + r] ++;
+            else
+                shards.send(thread, owner, thread * n_rows + r, 1, grad.data(), receive_own);
+        }
+
+        shards.finish(receive_own);
+    }
+
+    for (uint i = 0; i < received.size(); ++ i)
+        if (received[i] != 1)
+            failures ++;
+
+    bool ok = failures == 0;
+
+    std::cout << std::setw(44) << std::left << "update shards, 4 threads" << (ok ? "ok" : "FAILED") << std::endl;
+
+    return ok ? 0 : 1;
+}
+
+
+// Sharded training by several threads, where each sends rows of other owners to them and waits for their queues,
+// should finish and agree with unsharded one. Gradients don't depend on predictions and are small, so AdaGrad updates
+// are almost linear and their order hardly matters: change of predictions is compared to single-threaded one
+uint check_sharded_training() {
+    const uint n_threads = 4;
+    const float kappa = 0.01;
+
+    auto train = generate_examples(n_train * 16, 3);
+    auto test = std::vector<check_example>(train.begin(), train.begin() + n_test); // With trained interaction rows
+
+    ffm_model_dims dims { n_fields, 12, 14 };
+    std::vector<uint64_t> ones(dropout_mask_size, ~uint64_t(0));
+
+    auto train_model = [&](ffm_model & model, uint n_threads) {
+        uint n_batches = (train.size() + mini_batch_size - 1) / mini_batch_size;
+
+        #pragma omp parallel num_threads(n_threads)
+        {
+            for (uint b = omp_get_thread_num(); b < n_batches; b += omp_get_num_threads()) {
+                for (uint i = b * mini_batch_size; i < std::min<uint>((b + 1) * mini_batch_size, train.size()); ++ i) {
+                    const check_example & ex = train[i];
+                    const ffm_feature * start = ex.features.data(), * end = start + ex.features.size();
+
+                    model.update(start, end, ex.norm, -ex.y * kappa, ones.data(), 1);
+                }
+
+                model.merge_thread_updates();
+            }
+
+            model.flush_thread_updates();
+        }
+    };
+
+    auto predict_test = [&](ffm_model & model) {
+        std::vector<float> res;
+
+        for (uint i = 0; i < test.size(); ++ i)
+            res.push_back(model.predict(test[i].features.data(), test[i].features.data() + test[i].features.size(), test[i].norm, ones.data(), 1));
+
+        return res;
+    };
+
+    ffm_model ref_model(dims, 1, false, 0.2, 0.00002, ffm_weight_format::fp32, ffm_optimizer::adagrad, true);
+    auto initial = predict_test(ref_model);
+
+    train_model(ref_model, 1);
+    auto ref = predict_test(ref_model);
+
+    omp_set_num_threads(n_threads); // Shards are created for max number of threads
+    ffm_model model(dims, 1, false, 0.2, 0.00002, ffm_weight_format::fp32, ffm_optimizer::adagrad, false, true);
+    omp_set_num_threads(1);
+
+    train_model(model, n_threads);
+    auto res = predict_test(model);
+
+    float diff = 0, change = 0;
+
+    for (uint i = 0; i < test.size(); ++ i) {
+        diff += std::abs(res[i] - ref[i]);
+        change += std::abs(ref[i] - initial[i]);
+    }
+
+    float err = diff / change;
+    bool ok = err <= sharded_tolerance; // Not NaN
+
+    std::cout << std::setw(36) << std::left << "ffm sharded training" << std::setw(8) << (std::to_string(n_threads) + " thr") << std::right
+        << "rel error " << std::scientific << std::setprecision(2) << err << (ok ? "  ok" : "  FAILED") << std::endl;
+
+    return ok ? 0 : 1;
+}
+
+
+int main() {
+    uint failures = 0;
+
+    omp_set_num_threads(1);
+
+    ffm_model_dims dims { n_fields, 12, 0 };
+
+    for (uint n_dim : { 4, 14, 16 }) {
+        dims.n_dim = n_dim;
+
+        std::string dim = ", dim " + std::to_string(n_dim);
+
+        failures += check_model<ffm_model>("ffm adagrad" + dim, [&]() { return new ffm_model(dims, 1, false, 0.2, 0.00002); }, true);
+        failures += check_model<ffm_model>("ffm row-adagrad" + dim, [&]() { return new ffm_model(dims, 1, false, 0.2, 0.00002, ffm_weight_format::fp32, ffm_optimizer::row_adagrad); }, true);
+        failures += check_model<ffm_model>("ffm adagrad, aggregated" + dim, [&]() { return new ffm_model(dims, 1, false, 0.2, 0.00002, ffm_weight_format::fp32, ffm_optimizer::adagrad, true); });
+        failures += check_model<ffm_model>("ffm row-adagrad, aggregated" + dim, [&]() { return new ffm_model(dims, 1, false, 0.2, 0.00002, ffm_weight_format::fp32, ffm_optimizer::row_adagrad, true); });
+    }
+
+    dims.n_dim = 16;
+
+    failures += check_model<ffm_nn_model>("ffm-nn", [&]() { return new ffm_nn_model(dims, 1, false, 0.05, 0.00002, 0.0001); });
+    failures += check_model<nn_model>("nn", [&]() { return new nn_model(1, 0.02, 0.00002); });
+    failures += check_model<ftrl_model>("ftrl", [&]() { return new ftrl_model(16, 1.0, 2.0, 2e-4, 5e-4); });
+
+    failures += check_update_shards();
+    failures += check_update_shards_threads();
+    failures += check_sharded_training();
+
+    if (failures > 0) {
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "All checks passed" << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include "dropout.h"
+
+#include <cstring>
+
+// Dropout mask generation, compiled once per instruction set SIMD_ISA
+
+
+template <typename V>
+void fill_mask_rand_simd(uint64_t * mask, int size, int zero_prob_log, xoshiro256x4 & gen) {
+    for (int p = 0; p < size; p += 4) {
+        uint64_t v[4] = {0, 0, 0, 0}, r[4];
+
+        for (int i = 0; i < zero_prob_log; ++ i) {
+            gen.next(r);
+
+            for (int j = 0; j < 4; ++ j)
+                v[j] |= r[j];
+        }
+
+        memcpy(mask + p, v, sizeof(v));
+    }
+}
+
+
+template void fill_mask_rand_simd<SIMD_ISA>(uint64_t * mask, int size, int zero_prob_log, xoshiro256x4 & gen);
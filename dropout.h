@@ -0,0 +1,16 @@
+#pragma once
+
+#include "util/random.h"
+#include "util/simd.h"
+
+// Dropout masks of training examples. Generation is compiled once per instruction set, like model kernels,
+// so that interleaved generators of xoshiro256x4 are held in vector registers of the widest one supported
+
+
+// Fill mask with bits which are zero with probability 2^-zero_prob_log, 4 words at a time
+template <typename V>
+void fill_mask_rand_simd(uint64_t * mask, int size, int zero_prob_log, xoshiro256x4 & gen);
+
+inline void fill_mask_rand(uint64_t * mask, int size, int zero_prob_log, xoshiro256x4 & gen) {
+    dispatch_simd([&](auto v) { fill_mask_rand_simd<typename decltype(v)::type>(mask, size, zero_prob_log, gen); });
+}
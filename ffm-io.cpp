@@ -1,6 +1,12 @@
 #include <stdexcept>
 
 #include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "ffm.h"
 
@@ -115,6 +121,128 @@ void ffm_read_batch(const std::string & file_name, ffm_ulong from, ffm_ulong to,
     fclose(file);
 }
 
+// mapped data reading
+
+ffm_data_map::ffm_data_map(const std::string & file_name): addr(nullptr), length(0) {
+    using namespace std;
+
+    int fd = open(file_name.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw runtime_error(string("Can't open data file ") + file_name);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw runtime_error(string("Can't stat data file ") + file_name);
+    }
+
+    length = st.st_size;
+
+    // Empty file can't be mapped, but there is nothing to read from it anyway
+    if (length > 0) {
+        addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (addr == MAP_FAILED) {
+            close(fd);
+            throw runtime_error(string("Can't map data file ") + file_name);
+        }
+    }
+
+    close(fd);
+}
+
+ffm_data_map::~ffm_data_map() {
+    if (addr != nullptr)
+        munmap(addr, length);
+}
+
+void ffm_data_map::advise_sequential(bool sequential) const {
+    if (addr != nullptr)
+        madvise(addr, length, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+}
+
+void ffm_data_map::advise_willneed(ffm_ulong from, ffm_ulong to) const {
+    static const ffm_ulong page_size = sysconf(_SC_PAGESIZE);
+
+    if (to <= from)
+        return;
+
+    // Range should start at page boundary
+    ffm_ulong start = from * sizeof(ffm_feature) / page_size * page_size;
+    ffm_ulong end = to * sizeof(ffm_feature);
+
+    madvise((char *) addr + start, end - start, MADV_WILLNEED);
+}
+
+// cached data reading
+
+const ffm_ulong ffm_cache_align = 64 / sizeof(ffm_feature); // Align every file in cache to cache line
+
+ffm_data_cache::ffm_data_cache(ffm_ulong capacity, bool huge_pages): buffer(nullptr), capacity(capacity), used(0) {
+    if (capacity == 0)
+        return;
+
+    void * addr = mmap(nullptr, capacity * sizeof(ffm_feature), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED)
+        throw std::bad_alloc();
+
+    // Transparent huge pages are used if available, otherwise this hint is ignored
+    if (huge_pages)
+        madvise(addr, capacity * sizeof(ffm_feature), MADV_HUGEPAGE);
+
+    buffer = (ffm_feature *) addr;
+}
+
+ffm_data_cache::~ffm_data_cache() {
+    if (buffer != nullptr)
+        munmap(buffer, capacity * sizeof(ffm_feature));
+}
+
+const ffm_feature * ffm_data_cache::load(const std::string & file_name, ffm_ulong size) {
+    using namespace std;
+
+    if (used + size > capacity)
+        throw runtime_error("Data cache overflow");
+
+    ffm_feature * data = buffer + used;
+    used += (size + ffm_cache_align - 1) / ffm_cache_align * ffm_cache_align;
+
+    int fd = open(file_name.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw runtime_error(string("Can't open data file ") + file_name);
+
+    char * ptr = (char *) data;
+    ffm_ulong remaining = size * sizeof(ffm_feature);
+
+    while (remaining > 0) {
+        ssize_t res = read(fd, ptr, remaining);
+
+        if (res <= 0) {
+            close(fd);
+            throw runtime_error(string("Can't read data file ") + file_name);
+        }
+
+        ptr += res;
+        remaining -= res;
+    }
+
+    close(fd);
+
+    return data;
+}
+
+ffm_ulong ffm_data_cache::required_capacity(const std::vector<ffm_ulong> & sizes) {
+    ffm_ulong capacity = 0;
+
+    for (auto it = sizes.begin(); it != sizes.end(); ++ it)
+        capacity += (*it + ffm_cache_align - 1) / ffm_cache_align * ffm_cache_align;
+
+    return capacity;
+}
+
 // stream data writing
 
 ffm_stream_data_writer::ffm_stream_data_writer(const std::string & file_name): offset(0) {
@@ -138,3 +266,120 @@ ffm_ulong ffm_stream_data_writer::write(const std::vector<ffm_feature> & feature
 
     return offset;
 }
+
+// model checkpoints
+
+const char ffm_checkpoint_magic[8] = { 'F', 'F', 'M', 'C', 'K', 'P', 'T', 0 };
+const ffm_ulong ffm_checkpoint_align = 64;
+
+ffm_checkpoint_writer::ffm_checkpoint_writer(const std::string & file_name, const std::string & model_name, ffm_uint n_models): offset(0) {
+    using namespace std;
+
+    file = fopen(file_name.c_str(), "wb");
+
+    if(file == nullptr)
+        throw runtime_error(string("Can't open checkpoint file ") + file_name);
+
+    try {
+        write_raw(ffm_checkpoint_magic, sizeof(ffm_checkpoint_magic));
+        write(ffm_checkpoint_version);
+        write_array(model_name.data(), model_name.size());
+        write(n_models);
+    } catch (...) {
+        fclose((FILE *)file);
+        throw;
+    }
+}
+
+ffm_checkpoint_writer::~ffm_checkpoint_writer() {
+    if (file != nullptr)
+        fclose((FILE *)file);
+}
+
+void ffm_checkpoint_writer::close() {
+    FILE * f = (FILE *)file;
+    file = nullptr;
+
+    bool flushed = fflush(f) == 0;
+
+    if (fclose(f) != 0 || !flushed)
+        throw std::runtime_error("Error writing checkpoint");
+}
+
+void ffm_checkpoint_writer::write_raw(const void * data, ffm_ulong size) {
+    if (fwrite(data, 1, size, (FILE *)file) != size)
+        throw std::runtime_error("Error writing checkpoint");
+
+    offset += size;
+}
+
+void ffm_checkpoint_writer::align() {
+    static const char zeros[ffm_checkpoint_align] = {};
+
+    if (offset % ffm_checkpoint_align != 0)
+        write_raw(zeros, ffm_checkpoint_align - offset % ffm_checkpoint_align);
+}
+
+ffm_checkpoint_reader::ffm_checkpoint_reader(const std::string & file_name): offset(0) {
+    using namespace std;
+
+    int fd = open(file_name.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        throw runtime_error(string("Can't open checkpoint file ") + file_name);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw runtime_error(string("Can't stat checkpoint file ") + file_name);
+    }
+
+    size = st.st_size;
+
+    void * addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED)
+        throw runtime_error(string("Can't map checkpoint file ") + file_name);
+
+    madvise(addr, size, MADV_SEQUENTIAL);
+    data = (const char *) addr;
+
+    // Destructor isn't called if constructor throws, so mapping is released here
+    try {
+        char magic[sizeof(ffm_checkpoint_magic)];
+        read_raw(magic, sizeof(magic));
+
+        if (memcmp(magic, ffm_checkpoint_magic, sizeof(magic)) != 0)
+            throw runtime_error(file_name + " is not a checkpoint file");
+
+        if (read<ffm_uint>() != ffm_checkpoint_version)
+            throw runtime_error(string("Unsupported checkpoint version in ") + file_name);
+
+        model_name.resize(read<ffm_ulong>());
+        align();
+        read_raw(&model_name[0], model_name.size());
+
+        n_models = read<ffm_uint>();
+    } catch (...) {
+        munmap(addr, size);
+        throw;
+    }
+}
+
+ffm_checkpoint_reader::~ffm_checkpoint_reader() {
+    munmap((void *)data, size);
+}
+
+void ffm_checkpoint_reader::read_raw(void * dst, ffm_ulong n) {
+    if (offset + n > size)
+        throw std::runtime_error("Unexpected end of checkpoint");
+
+    memcpy(dst, data + offset, n);
+    offset += n;
+}
+
+void ffm_checkpoint_reader::align() {
+    if (offset % ffm_checkpoint_align != 0)
+        offset += ffm_checkpoint_align - offset % ffm_checkpoint_align;
+}
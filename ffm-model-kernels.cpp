@@ -0,0 +1,547 @@
+#include "ffm-model-kernels.h"
+#include "util/sparse-gradients.h"
+#include "util/update-shards.h"
+
+#include <omp.h>
+
+// Prediction and update kernels of ffm model, compiled once per instruction set SIMD_ISA
+
+constexpr uint prefetch_depth = 1;
+
+
+// Random bits for stochastic rounding, stream per worker thread
+static xoshiro256x4 & rounding_generator() {
+    static thread_local xoshiro256x4 gen(mix_seed(0x5eed, omp_get_thread_num()));
+    return gen;
+}
+
+
+// Gradients accumulated by thread over mini-batch, when updates are aggregated
+struct aggregated_gradients {
+    sparse_gradients interactions; // By row number, index * n_fields + field
+    sparse_gradients linear; // By feature index
+    float bias = 0;
+};
+
+static thread_local aggregated_gradients local_gradients;
+
+
+template <typename O, typename T>
+inline void prefetch_interaction_weights(const T * addr) {
+    for (uint i = 0, sz = O::field_stride * sizeof(T); i < sz; i += 64)
+        _mm_prefetch(((const char *)addr) + i, _MM_HINT_T1);
+}
+
+
+template <typename V>
+ffm_float ffm_model::predict_simd(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult) {
+    if (weight_format == ffm_weight_format::int8)
+        return dispatch_dim(n_dim, [&](auto n) { return this->predict_int8<V, decltype(n)>(start, end, norm, dropout_mask, dropout_mult); });
+
+    return dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        return this->predict_impl<V, decltype(w), decltype(o)>(start, end, norm, dropout_mask, dropout_mult);
+    });
+}
+
+
+template <typename V>
+void ffm_model::update_simd(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult) {
+    dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        if (aggregate_updates)
+            this->accumulate_impl<V, decltype(w), decltype(o)>(start, end, norm, kappa, dropout_mask, dropout_mult);
+        else
+            this->update_impl<V, decltype(w), decltype(o)>(start, end, norm, kappa, dropout_mask, dropout_mult);
+    });
+}
+
+
+template <typename V>
+void ffm_model::predict_group_simd(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions) {
+    if (weight_format == ffm_weight_format::int8) {
+        dispatch_dim(n_dim, [&](auto d) {
+            for (uint k = 0; k < n; ++ k)
+                predictions[k] = this->predict_int8<V, decltype(d)>(examples[k].start, examples[k].end, examples[k].norm, examples[k].dropout_mask, dropout_mult);
+        });
+        return;
+    }
+
+    dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        this->predict_group_impl<V, decltype(w), decltype(o)>(examples, n, dropout_mult, predictions);
+    });
+}
+
+
+template <typename V>
+void ffm_model::apply_updates_simd() {
+    dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        this->apply_updates_impl<V, decltype(w), decltype(o)>();
+    });
+}
+
+
+template <typename V>
+void ffm_model::receive_updates_simd(uint owner) {
+    dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        this->receive_updates_impl<V, decltype(w), decltype(o)>(owner);
+    });
+}
+
+
+template <typename V, typename N>
+ffm_float ffm_model::predict_int8(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult) {
+    constexpr ffm_ulong field_stride = N::int8_field_stride;
+    constexpr ffm_ulong scale_offset = N::int8_scale_offset;
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    const int8_t * weights = (const int8_t *) ffm_weights;
+
+    ffm_float linear_total = bias_w;
+    ffm_float linear_norm = end - start;
+
+    ffm_float total = 0;
+
+    ffm_uint i = 0;
+
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        ffm_uint index_a = fa->index & hash_mask;
+        ffm_uint field_a = fa->index >> ffm_hash_bits;
+        ffm_float value_a = fa->value;
+
+        linear_total += value_a * lin_weights[index_a] / linear_norm;
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
+            ffm_uint index_b = fb->index & hash_mask;
+            ffm_uint field_b = fb->index >> ffm_hash_bits;
+            ffm_float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
+                ffm_uint index_p = fb[prefetch_depth].index & hash_mask;
+                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                _mm_prefetch((const char *) (weights + index_p * index_stride + field_a * field_stride), _MM_HINT_T1);
+                _mm_prefetch((const char *) (weights + index_a * index_stride + field_p * field_stride), _MM_HINT_T1);
+            }
+
+            if (test_mask_bit(dropout_mask, i) == 0)
+                continue;
+
+            const int8_t * wa = weights + index_a * index_stride + field_b * field_stride;
+            const int8_t * wb = weights + index_b * index_stride + field_a * field_stride;
+
+            float scale = V::fp16_to_float(*(const uint16_t *)(wa + scale_offset)) * V::fp16_to_float(*(const uint16_t *)(wb + scale_offset));
+
+            total += V::dot_int8(wa, wb, N::n_dim) * (scale * dropout_mult * value_a * value_b / norm);
+        }
+    }
+
+    return total + linear_total;
+}
+
+
+template <typename V, typename W, typename O>
+ffm_float ffm_model::predict_impl(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult) {
+    typedef typename V::vec vec;
+    typedef typename W::type weight_type;
+
+    constexpr ffm_ulong field_stride = O::field_stride;
+    constexpr ffm_uint span = V::span(O::n_dim);
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    weight_type * weights = (weight_type *) ffm_weights;
+
+    ffm_float linear_total = bias_w;
+    ffm_float linear_norm = end - start;
+
+    vec v_total = V::zero();
+
+    ffm_uint i = 0;
+
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        ffm_uint index_a = fa->index & hash_mask;
+        ffm_uint field_a = fa->index >> ffm_hash_bits;
+        ffm_float value_a = fa->value;
+
+        linear_total += value_a * lin_weights[index_a * O::lin_stride] / linear_norm;
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
+            ffm_uint index_b = fb->index & hash_mask;
+            ffm_uint field_b = fb->index >> ffm_hash_bits;
+            ffm_float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
+                ffm_uint index_p = fb[prefetch_depth].index & hash_mask;
+                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                prefetch_interaction_weights<O>(weights + index_p * index_stride + field_a * field_stride);
+                prefetch_interaction_weights<O>(weights + index_a * index_stride + field_p * field_stride);
+            }
+
+            if (test_mask_bit(dropout_mask, i) == 0)
+                continue;
+
+            //if (field_a == field_b)
+            //    continue;
+
+            weight_type * wa = weights + index_a * index_stride + field_b * field_stride;
+            weight_type * wb = weights + index_b * index_stride + field_a * field_stride;
+
+            vec v_val = V::set1(dropout_mult * value_a * value_b / norm);
+
+            for(ffm_uint d = 0; d < span; d += V::width) {
+                ffm_uint n = simd_lanes<V>(d, span);
+
+                vec v_wa = W::template load<V>(wa + d, n);
+                vec v_wb = W::template load<V>(wb + d, n);
+
+                v_total = V::fmadd(O::template mask_weights<V>(v_wa * v_wb, d), v_val, v_total);
+            }
+        }
+    }
+
+    return V::sum(v_total) + linear_total;
+}
+
+
+template <typename V, typename W, typename O>
+void ffm_model::update_impl(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult) {
+    typedef typename W::type weight_type;
+
+    constexpr ffm_ulong field_stride = O::field_stride;
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    weight_type * weights = (weight_type *) ffm_weights;
+    xoshiro256x4 & gen = rounding_generator();
+
+    ffm_float linear_norm = end - start;
+
+    typename V::vec v_eta = V::set1(eta);
+    typename V::vec v_lambda = V::set1(lambda);
+
+    ffm_uint i = 0;
+
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        ffm_uint index_a = fa->index & hash_mask;
+        ffm_uint field_a = fa->index >> ffm_hash_bits;
+        ffm_float value_a = fa->value;
+
+        ffm_float g = lambda * lin_weights[index_a*2] + kappa * value_a / linear_norm;
+        ffm_float wg = lin_weights[index_a*2 + 1] + g*g;
+
+        lin_weights[index_a*2] -= eta * g / sqrt(wg);
+        lin_weights[index_a*2 + 1] = wg;
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
+            ffm_uint index_b = fb->index & hash_mask;
+            ffm_uint field_b = fb->index >> ffm_hash_bits;
+            ffm_float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
+                ffm_uint index_p = fb[prefetch_depth].index & hash_mask;
+                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                prefetch_interaction_weights<O>(weights + index_p * index_stride + field_a * field_stride);
+                prefetch_interaction_weights<O>(weights + index_a * index_stride + field_p * field_stride);
+            }
+
+            if (test_mask_bit(dropout_mask, i) == 0)
+                continue;
+
+            //if (field_a == field_b)
+            //    continue;
+
+            weight_type * wa = weights + index_a * index_stride + field_b * field_stride;
+            weight_type * wb = weights + index_b * index_stride + field_a * field_stride;
+
+            typename V::vec v_kappa_val = V::set1(kappa * dropout_mult * value_a * value_b / norm);
+
+            O::template update<V, W>(wa, wb, v_kappa_val, v_lambda, v_eta, gen);
+        }
+    }
+
+    // Update bias
+    bias_wg += kappa;
+    bias_w -= eta * kappa / sqrt(bias_wg);
+}
+
+
+// Number of leading features which are the same in all examples of group, event features of display
+static ffm_uint shared_prefix_size(const ffm_batch_example * examples, uint n) {
+    const ffm_feature * first = examples[0].start;
+    ffm_uint size = examples[0].end - first;
+
+    for (uint k = 1; k < n; ++ k) {
+        const ffm_feature * f = examples[k].start;
+        ffm_uint max_size = std::min<ffm_uint>(size, examples[k].end - f);
+
+        size = 0;
+
+        while (size < max_size && f[size].index == first[size].index && f[size].value == first[size].value)
+            ++ size;
+    }
+
+    return size;
+}
+
+
+template <typename V, typename W, typename O>
+typename V::vec ffm_model::predict_features(const ffm_feature * start, const ffm_feature * from, const ffm_feature * end, ffm_uint & i, uint64_t * dropout_mask, float linear_scale, float pair_scale, float & linear_total) {
+    typedef typename V::vec vec;
+    typedef typename W::type weight_type;
+
+    constexpr ffm_ulong field_stride = O::field_stride;
+    constexpr ffm_uint span = V::span(O::n_dim);
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    weight_type * weights = (weight_type *) ffm_weights;
+
+    vec v_total = V::zero();
+
+    for (const ffm_feature * fa = from; fa != end; ++ fa) {
+        ffm_uint index_a = fa->index & hash_mask;
+        ffm_uint field_a = fa->index >> ffm_hash_bits;
+        ffm_float value_a = fa->value;
+
+        linear_total += value_a * lin_weights[index_a * O::lin_stride] * linear_scale;
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
+            ffm_uint index_b = fb->index & hash_mask;
+            ffm_uint field_b = fb->index >> ffm_hash_bits;
+            ffm_float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
+                ffm_uint index_p = fb[prefetch_depth].index & hash_mask;
+                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                prefetch_interaction_weights<O>(weights + index_p * index_stride + field_a * field_stride);
+                prefetch_interaction_weights<O>(weights + index_a * index_stride + field_p * field_stride);
+            }
+
+            if (test_mask_bit(dropout_mask, i) == 0)
+                continue;
+
+            weight_type * wa = weights + index_a * index_stride + field_b * field_stride;
+            weight_type * wb = weights + index_b * index_stride + field_a * field_stride;
+
+            vec v_val = V::set1(pair_scale * value_a * value_b);
+
+            for(ffm_uint d = 0; d < span; d += V::width) {
+                ffm_uint n = simd_lanes<V>(d, span);
+
+                vec v_wa = W::template load<V>(wa + d, n);
+                vec v_wb = W::template load<V>(wb + d, n);
+
+                v_total = V::fmadd(O::template mask_weights<V>(v_wa * v_wb, d), v_val, v_total);
+            }
+        }
+    }
+
+    return v_total;
+}
+
+
+// Shared prefix terms are computed once without per-example scale, which is applied to their sums
+template <typename V, typename W, typename O>
+void ffm_model::predict_group_impl(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions) {
+    const ffm_feature * start = examples[0].start;
+    const ffm_feature * prefix_end = start + shared_prefix_size(examples, n);
+
+    ffm_uint prefix_pairs = 0;
+    ffm_float prefix_linear = 0;
+    ffm_float prefix_total = V::sum(predict_features<V, W, O>(start, start, prefix_end, prefix_pairs, examples[0].dropout_mask, 1, 1, prefix_linear));
+
+    for (uint k = 0; k < n; ++ k) {
+        ffm_batch_example & ex = examples[k];
+
+        ffm_float linear_norm = ex.end - ex.start;
+        ffm_float linear_total = bias_w + prefix_linear / linear_norm;
+
+        ffm_uint i = prefix_pairs;
+
+        auto v_total = predict_features<V, W, O>(ex.start, ex.start + (prefix_end - start), ex.end, i, ex.dropout_mask, 1 / linear_norm, dropout_mult / ex.norm, linear_total);
+
+        predictions[k] = V::sum(v_total) + prefix_total * dropout_mult / ex.norm + linear_total;
+    }
+}
+
+
+// Add gradient of pair of interaction rows to the one of row g, weights are not changed until mini-batch ends
+template <typename V, typename W, typename O>
+inline void accumulate_row_gradient(float * g, const typename W::type * w_other, typename V::vec v_kappa_val) {
+    constexpr ffm_uint span = V::span(O::n_dim);
+
+    for (ffm_uint d = 0; d < span; d += V::width) {
+        ffm_uint n = simd_lanes<V>(d, span);
+
+        V::store(g + d, V::fmadd(O::template mask_weights<V>(W::template load<V>(w_other + d, n), d), v_kappa_val, V::load(g + d, n)), n);
+    }
+}
+
+
+template <typename V, typename W, typename O>
+void ffm_model::accumulate_impl(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult) {
+    typedef typename W::type weight_type;
+
+    constexpr ffm_ulong field_stride = O::field_stride;
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    weight_type * weights = (weight_type *) ffm_weights;
+    aggregated_gradients & grads = local_gradients;
+
+    // Gradient rows have room for accumulator lane of row-wise AdaGrad, which stays zero
+    if (grads.interactions.size() == 0)
+        grads.interactions.clear(O::n_dim + 1);
+
+    if (grads.linear.size() == 0)
+        grads.linear.clear(1);
+
+    ffm_float linear_norm = end - start;
+
+    ffm_uint i = 0;
+
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        ffm_uint index_a = fa->index & hash_mask;
+        ffm_uint field_a = fa->index >> ffm_hash_bits;
+        ffm_float value_a = fa->value;
+
+        grads.linear.row(index_a)[0] += kappa * value_a / linear_norm;
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
+            ffm_uint index_b = fb->index & hash_mask;
+            ffm_uint field_b = fb->index >> ffm_hash_bits;
+            ffm_float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
+                ffm_uint index_p = fb[prefetch_depth].index & hash_mask;
+                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                prefetch_interaction_weights<O>(weights + index_p * index_stride + field_a * field_stride);
+                prefetch_interaction_weights<O>(weights + index_a * index_stride + field_p * field_stride);
+            }
+
+            if (test_mask_bit(dropout_mask, i) == 0)
+                continue;
+
+            const weight_type * wa = weights + index_a * index_stride + field_b * field_stride;
+            const weight_type * wb = weights + index_b * index_stride + field_a * field_stride;
+
+            typename V::vec v_kappa_val = V::set1(kappa * dropout_mult * value_a * value_b / norm);
+
+            // Rows are taken one at a time, as taking next one may move gradient buffer
+            accumulate_row_gradient<V, W, O>(grads.interactions.row(ffm_ulong(index_a) * n_fields + field_b), wb, v_kappa_val);
+            accumulate_row_gradient<V, W, O>(grads.interactions.row(ffm_ulong(index_b) * n_fields + field_a), wa, v_kappa_val);
+        }
+    }
+
+    grads.bias += kappa;
+}
+
+
+template <typename V, typename W, typename O>
+void ffm_model::apply_updates_impl() {
+    typedef typename W::type weight_type;
+
+    aggregated_gradients & grads = local_gradients;
+
+    weight_type * weights = (weight_type *) ffm_weights;
+    xoshiro256x4 & gen = rounding_generator();
+
+    typename V::vec v_eta = V::set1(eta);
+
+    uint thread = omp_get_thread_num();
+    bool sharded = shards != nullptr && uint(omp_get_num_threads()) == shards->size();
+
+    // Interaction rows, regularized once per hit as in unaggregated updates. Rows of other owners are sent to them
+    for (uint r = 0; r < grads.interactions.size(); ++ r) {
+        ffm_ulong key = grads.interactions.key(r);
+
+        if (sharded) {
+            uint owner = shards->owner(key / n_fields);
+
+            if (owner != thread) {
+                shards->send(thread, owner, key, grads.interactions.hits(r), grads.interactions.data(r), [&]() { this->receive_updates_impl<V, W, O>(thread); });
+                continue;
+            }
+        }
+
+        O::template apply<V, W>(weights + key * O::field_stride, grads.interactions.data(r), V::set1(lambda * grads.interactions.hits(r)), v_eta, gen);
+    }
+
+    if (sharded)
+        receive_updates_impl<V, W, O>(thread);
+
+    for (uint r = 0; r < grads.linear.size(); ++ r) {
+        ffm_ulong index = grads.linear.key(r);
+
+        ffm_float g = lambda * grads.linear.hits(r) * lin_weights[index*2] + grads.linear.data(r)[0];
+        ffm_float wg = lin_weights[index*2 + 1] + g*g;
+
+        lin_weights[index*2] -= eta * g / sqrt(wg);
+        lin_weights[index*2 + 1] = wg;
+    }
+
+    if (grads.linear.size() > 0) {
+        bias_wg += grads.bias;
+        bias_w -= eta * grads.bias / sqrt(bias_wg);
+    }
+
+    grads.interactions.clear(O::n_dim + 1);
+    grads.linear.clear(1);
+    grads.bias = 0;
+}
+
+
+// Apply updates of interaction rows sent to owner thread by other ones
+template <typename V, typename W, typename O>
+void ffm_model::receive_updates_impl(uint owner) {
+    typedef typename W::type weight_type;
+
+    weight_type * weights = (weight_type *) ffm_weights;
+    xoshiro256x4 & gen = rounding_generator();
+
+    typename V::vec v_eta = V::set1(eta);
+
+    shards->receive(owner, [&](uint64_t key, uint hits, const float * grad) {
+        O::template apply<V, W>(weights + key * O::field_stride, grad, V::set1(lambda * hits), v_eta, gen);
+    });
+}
+
+template ffm_float ffm_model::predict_simd<SIMD_ISA>(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult);
+template void ffm_model::update_simd<SIMD_ISA>(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult);
+template void ffm_model::predict_group_simd<SIMD_ISA>(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+template void ffm_model::apply_updates_simd<SIMD_ISA>();
+template void ffm_model::receive_updates_simd<SIMD_ISA>(uint owner);
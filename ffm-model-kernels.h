@@ -0,0 +1,331 @@
+#pragma once
+
+#include "ffm-model.h"
+#include "util/model-helpers.h"
+#include "util/simd.h"
+
+// Row layouts and kernel building blocks of ffm model, vector parts are templates on instruction set V
+// and are instantiated only in kernel objects
+
+
+// Latent vector size, kernels are compiled for each supported one
+template <ffm_uint D>
+struct ffm_dim {
+    static constexpr ffm_uint n_dim = D;
+    static constexpr ffm_uint n_dim_aligned = aligned_float_array_size(D);
+
+    // Quantized rows of inference-only models: n_dim int8 weights, then fp16 row scale in last two bytes, padded to 16 bytes
+    static constexpr ffm_ulong int8_field_stride = (D + 2 + 15) / 16 * 16;
+    static constexpr ffm_ulong int8_scale_offset = int8_field_stride - 2;
+};
+
+
+// Interaction weight storage formats, load and store n leading values of block as fp32 vector
+
+struct ffm_fp32_weights {
+    typedef float type;
+
+    template <typename V>
+    static typename V::vec load(const float * p, uint n) { return V::load(p, n); }
+
+    template <typename V>
+    static void store(float * p, typename V::vec v, uint n, xoshiro256x4 &) { V::store(p, v, n); }
+
+    static float convert(float v) { return v; }
+    static float to_float(float v) { return v; }
+};
+
+struct ffm_fp16_weights {
+    typedef uint16_t type;
+
+    template <typename V>
+    static typename V::vec load(const uint16_t * p, uint n) { return V::load_fp16(p, n); }
+
+    template <typename V>
+    static void store(uint16_t * p, typename V::vec v, uint n, xoshiro256x4 & gen) { V::store_fp16_stochastic(p, v, gen, n); }
+
+    static uint16_t convert(float v) { return float_to_fp16(v); }
+    static float to_float(uint16_t v) { return fp16_to_float(v); }
+};
+
+struct ffm_bf16_weights {
+    typedef uint16_t type;
+
+    template <typename V>
+    static typename V::vec load(const uint16_t * p, uint n) { return V::load_bf16(p, n); }
+
+    template <typename V>
+    static void store(uint16_t * p, typename V::vec v, uint n, xoshiro256x4 & gen) { V::store_bf16_stochastic(p, v, gen, n); }
+
+    static uint16_t convert(float v) { return float_to_bf16(v); }
+    static float to_float(uint16_t v) { return bf16_to_float(v); }
+};
+
+
+// Optimizers of interaction weights, define row layout and update of pair of rows
+
+// Accumulator per coordinate, stored in second half of row
+template <typename N>
+struct ffm_adagrad {
+    static constexpr ffm_uint n_dim = N::n_dim;
+    static constexpr ffm_uint n_dim_aligned = N::n_dim_aligned;
+
+    static constexpr ffm_ulong field_stride = n_dim_aligned * 2;
+    static constexpr ffm_ulong lin_stride = 2; // Linear weight and its accumulator
+
+    // Initial value of row element after weights
+    static float initial_state(ffm_uint d) { return d >= n_dim_aligned ? 1 : 0; }
+
+    // Zero row elements which are not weights in block starting at d
+    template <typename V>
+    static typename V::vec mask_weights(typename V::vec v, ffm_uint) { return v; }
+
+    template <typename V, typename W>
+    static void update(typename W::type * wa, typename W::type * wb, typename V::vec v_kappa_val, typename V::vec v_lambda, typename V::vec v_eta, xoshiro256x4 & gen) {
+        typedef typename V::vec vec;
+
+        constexpr ffm_uint span = V::span(n_dim);
+
+        typename W::type * wga = wa + n_dim_aligned;
+        typename W::type * wgb = wb + n_dim_aligned;
+
+        for (ffm_uint d = 0; d < span; d += V::width) {
+            ffm_uint n = simd_lanes<V>(d, span);
+
+            // Load weights
+            vec v_wa = W::template load<V>(wa + d, n);
+            vec v_wb = W::template load<V>(wb + d, n);
+
+            vec v_wga = W::template load<V>(wga + d, n);
+            vec v_wgb = W::template load<V>(wgb + d, n);
+
+            // Compute gradient values
+            vec v_ga = V::fmadd(v_lambda, v_wa, v_kappa_val * v_wb);
+            vec v_gb = V::fmadd(v_lambda, v_wb, v_kappa_val * v_wa);
+
+            // Update weights
+            v_wga = V::fmadd(v_ga, v_ga, v_wga);
+            v_wgb = V::fmadd(v_gb, v_gb, v_wgb);
+
+            v_wa = V::fnmadd(v_eta, V::rsqrt(v_wga) * v_ga, v_wa);
+            v_wb = V::fnmadd(v_eta, V::rsqrt(v_wgb) * v_gb, v_wb);
+
+            // Store weights
+            W::template store<V>(wa + d, v_wa, n, gen);
+            W::template store<V>(wb + d, v_wb, n, gen);
+
+            W::template store<V>(wga + d, v_wga, n, gen);
+            W::template store<V>(wgb + d, v_wgb, n, gen);
+        }
+    }
+
+    // Update of single row by its data gradient g, summed over mini-batch, with regularization of each hit in v_lambda
+    template <typename V, typename W>
+    static void apply(typename W::type * w, const float * g, typename V::vec v_lambda, typename V::vec v_eta, xoshiro256x4 & gen) {
+        typedef typename V::vec vec;
+
+        constexpr ffm_uint span = V::span(n_dim);
+
+        typename W::type * wg = w + n_dim_aligned;
+
+        for (ffm_uint d = 0; d < span; d += V::width) {
+            ffm_uint n = simd_lanes<V>(d, span);
+
+            vec v_w = W::template load<V>(w + d, n);
+            vec v_wg = W::template load<V>(wg + d, n);
+
+            vec v_g = V::fmadd(v_lambda, v_w, V::load(g + d, n));
+
+            v_wg = V::fmadd(v_g, v_g, v_wg);
+            v_w = V::fnmadd(v_eta, V::rsqrt(v_wg) * v_g, v_w);
+
+            W::template store<V>(w + d, v_w, n, gen);
+            W::template store<V>(wg + d, v_wg, n, gen);
+        }
+    }
+};
+
+// Single accumulator of mean squared gradient per row, stored in element n_dim right after weights
+template <typename N>
+struct ffm_row_adagrad {
+    static constexpr ffm_uint n_dim = N::n_dim;
+    static constexpr ffm_uint n_dim_aligned = N::n_dim_aligned;
+
+    static constexpr ffm_ulong field_stride = aligned_float_array_size(n_dim + 1);
+    static constexpr ffm_ulong lin_stride = 2;
+
+    static float initial_state(ffm_uint d) { return d == n_dim ? 1 : 0; }
+
+    template <typename V>
+    static typename V::vec mask_weights(typename V::vec v, ffm_uint d) {
+        return d + V::width > n_dim ? V::mask_below(v, n_dim, d) : v;
+    }
+
+    template <typename V, typename W>
+    static void update(typename W::type * wa, typename W::type * wb, typename V::vec v_kappa_val, typename V::vec v_lambda, typename V::vec v_eta, xoshiro256x4 & gen) {
+        typedef typename V::vec vec;
+
+        constexpr ffm_uint span = V::span(n_dim + 1); // Weights and accumulator
+        constexpr ffm_uint n_blocks = (span + V::width - 1) / V::width;
+        constexpr ffm_uint acc_block = n_dim / V::width;
+
+        vec v_wa[n_blocks], v_wb[n_blocks];
+        vec v_ga[n_blocks], v_gb[n_blocks];
+
+        vec v_ssa = V::zero();
+        vec v_ssb = V::zero();
+
+        // Compute gradients of whole rows, zero in accumulator and padding lanes
+        for (ffm_uint b = 0; b < n_blocks; b++) {
+            ffm_uint d = b * V::width, n = simd_lanes<V>(d, span);
+
+            v_wa[b] = W::template load<V>(wa + d, n);
+            v_wb[b] = W::template load<V>(wb + d, n);
+
+            v_ga[b] = mask_weights<V>(V::fmadd(v_lambda, v_wa[b], v_kappa_val * v_wb[b]), d);
+            v_gb[b] = mask_weights<V>(V::fmadd(v_lambda, v_wb[b], v_kappa_val * v_wa[b]), d);
+
+            v_ssa = V::fmadd(v_ga[b], v_ga[b], v_ssa);
+            v_ssb = V::fmadd(v_gb[b], v_gb[b], v_ssb);
+        }
+
+        // Update accumulators in all lanes, so rates are computed without leaving vector registers
+        const vec v_inv_n_dim = V::set1(1.0f / n_dim);
+
+        vec v_wga = V::fmadd(V::sum_all(v_ssa), v_inv_n_dim, V::broadcast_lane(v_wa[acc_block], n_dim - acc_block * V::width));
+        vec v_wgb = V::fmadd(V::sum_all(v_ssb), v_inv_n_dim, V::broadcast_lane(v_wb[acc_block], n_dim - acc_block * V::width));
+
+        vec v_rate_a = v_eta * V::rsqrt(v_wga);
+        vec v_rate_b = v_eta * V::rsqrt(v_wgb);
+
+        // Update and store weights, accumulator lane is not changed by zero gradient, so it's replaced by new value
+        for (ffm_uint b = 0; b < n_blocks; b++) {
+            ffm_uint d = b * V::width, n = simd_lanes<V>(d, span);
+
+            v_wa[b] = V::fnmadd(v_rate_a, v_ga[b], v_wa[b]);
+            v_wb[b] = V::fnmadd(v_rate_b, v_gb[b], v_wb[b]);
+
+            if (b == acc_block) {
+                v_wa[b] = V::set_lane(v_wa[b], v_wga, n_dim, d);
+                v_wb[b] = V::set_lane(v_wb[b], v_wgb, n_dim, d);
+            }
+
+            W::template store<V>(wa + d, v_wa[b], n, gen);
+            W::template store<V>(wb + d, v_wb[b], n, gen);
+        }
+    }
+
+    template <typename V, typename W>
+    static void apply(typename W::type * w, const float * g, typename V::vec v_lambda, typename V::vec v_eta, xoshiro256x4 & gen) {
+        typedef typename V::vec vec;
+
+        constexpr ffm_uint span = V::span(n_dim + 1);
+        constexpr ffm_uint n_blocks = (span + V::width - 1) / V::width;
+        constexpr ffm_uint acc_block = n_dim / V::width;
+
+        vec v_w[n_blocks], v_g[n_blocks];
+        vec v_ss = V::zero();
+
+        for (ffm_uint b = 0; b < n_blocks; b++) {
+            ffm_uint d = b * V::width, n = simd_lanes<V>(d, span);
+
+            v_w[b] = W::template load<V>(w + d, n);
+            v_g[b] = mask_weights<V>(V::fmadd(v_lambda, v_w[b], V::load(g + d, n)), d);
+
+            v_ss = V::fmadd(v_g[b], v_g[b], v_ss);
+        }
+
+        vec v_wg = V::fmadd(V::sum_all(v_ss), V::set1(1.0f / n_dim), V::broadcast_lane(v_w[acc_block], n_dim - acc_block * V::width));
+        vec v_rate = v_eta * V::rsqrt(v_wg);
+
+        for (ffm_uint b = 0; b < n_blocks; b++) {
+            ffm_uint d = b * V::width, n = simd_lanes<V>(d, span);
+
+            v_w[b] = V::fnmadd(v_rate, v_g[b], v_w[b]);
+
+            if (b == acc_block)
+                v_w[b] = V::set_lane(v_w[b], v_wg, n_dim, d);
+
+            W::template store<V>(w + d, v_w[b], n, gen);
+        }
+    }
+};
+
+
+// Inference-only layout, contiguous weights padded to n_dim_aligned, linear weights without accumulators
+template <typename N>
+struct ffm_no_optimizer {
+    static constexpr ffm_uint n_dim = N::n_dim;
+    static constexpr ffm_uint n_dim_aligned = N::n_dim_aligned;
+
+    static constexpr ffm_ulong field_stride = n_dim_aligned;
+    static constexpr ffm_ulong lin_stride = 1;
+
+    static float initial_state(ffm_uint) { return 0; }
+
+    template <typename V>
+    static typename V::vec mask_weights(typename V::vec v, ffm_uint) { return v; }
+
+    // Not used, model refuses updates without optimizer state
+    template <typename V, typename W>
+    static void update(typename W::type *, typename W::type *, typename V::vec, typename V::vec, typename V::vec, xoshiro256x4 &) {}
+
+    template <typename V, typename W>
+    static void apply(typename W::type *, const float *, typename V::vec, typename V::vec, xoshiro256x4 &) {}
+};
+
+
+// Call f with storage format of model as template tag argument, quantized format has its own kernels
+template <typename F>
+auto dispatch_format(ffm_weight_format format, F f) -> decltype(f(ffm_fp32_weights())) {
+    switch (format) {
+    case ffm_weight_format::fp16:
+        return f(ffm_fp16_weights());
+    case ffm_weight_format::bf16:
+        return f(ffm_bf16_weights());
+    case ffm_weight_format::int8:
+        throw std::runtime_error("Operation is not supported for int8 weights");
+    default:
+        return f(ffm_fp32_weights());
+    }
+}
+
+
+// Call f with latent vector size as template tag argument
+template <typename F>
+auto dispatch_dim(ffm_uint n_dim, F f) -> decltype(f(ffm_dim<14>())) {
+    switch (n_dim) {
+    case 4:
+        return f(ffm_dim<4>());
+    case 8:
+        return f(ffm_dim<8>());
+    case 14:
+        return f(ffm_dim<14>());
+    case 16:
+        return f(ffm_dim<16>());
+    case 32:
+        return f(ffm_dim<32>());
+    default:
+        throw std::runtime_error(std::string("Unsupported ffm dimension ") + std::to_string(n_dim) + ", should be one of 4, 8, 14, 16 or 32");
+    }
+}
+
+
+// Call f with storage format and optimizer (with its row layout) of model as template tag arguments
+template <typename F>
+auto dispatch_kernel(ffm_weight_format format, ffm_optimizer optimizer, ffm_uint n_dim, F f) -> decltype(f(ffm_fp32_weights(), ffm_adagrad<ffm_dim<14>>())) {
+    return dispatch_format(format, [&](auto w) {
+        return dispatch_dim(n_dim, [&](auto n) {
+            typedef decltype(n) N;
+
+            switch (optimizer) {
+            case ffm_optimizer::row_adagrad:
+                return f(w, ffm_row_adagrad<N>());
+            case ffm_optimizer::none:
+                return f(w, ffm_no_optimizer<N>());
+            default:
+                return f(w, ffm_adagrad<N>());
+            }
+        });
+    });
+}
@@ -1,58 +1,55 @@
 #include "ffm-model.h"
-#include "util/model-helpers.h"
+#include "ffm-model-kernels.h"
+#include "util/update-shards.h"
 
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <algorithm>
 
-constexpr ffm_ulong n_fields = 40;
-constexpr ffm_ulong n_features = 1 << ffm_hash_bits;
+#include <omp.h>
 
-constexpr ffm_ulong n_dim = 14;
-constexpr ffm_ulong n_dim_aligned = ((n_dim - 1) / align_floats + 1) * align_floats;
 
-constexpr ffm_ulong index_stride = n_fields * n_dim_aligned * 2;
-constexpr ffm_ulong field_stride = n_dim_aligned * 2;
+// Rows are initialized in parallel unless numa policy is active, values depend only on seed and row
+template <typename W, typename O>
+static void init_ffm_weights(typename W::type * weights, ffm_ulong n, ffm_float min, ffm_float max, uint64_t seed) {
+    #pragma omp parallel for schedule(static) if (parallel_first_touch())
+    for(ffm_ulong i = 0; i < n; i++) {
+        typename W::type * w = weights + i * O::field_stride;
 
-constexpr uint prefetch_depth = 1;
+        for (ffm_uint d = 0; d < O::n_dim; d++)
+            w[d] = W::convert(counter_uniform(seed, i * O::n_dim + d, min, max));
 
-
-inline void prefetch_interaction_weights(float * addr) {
-    for (uint i = 0, sz = field_stride * sizeof(float); i < sz; i += 64)
-        _mm_prefetch(((char *)addr) + i, _MM_HINT_T1);
+        for (ffm_uint d = O::n_dim; d < O::field_stride; d++)
+            w[d] = W::convert(O::initial_state(d));
+    }
 }
 
 
-template <typename D>
-static void init_ffm_weights(ffm_float * weights, ffm_uint n, D gen, std::default_random_engine & rnd) {
-    ffm_float * w = weights;
-
-    for(ffm_uint i = 0; i < n; i++) {
-        for (ffm_uint d = 0; d < n_dim; d++, w++)
-            *w = gen(rnd);
-
-        for (ffm_uint d = n_dim; d < n_dim_aligned; d++, w++)
-            *w = 0;
+static void init_lin_weights(ffm_float * weights, ffm_ulong n, ffm_ulong stride) {
+    #pragma omp parallel for schedule(static) if (parallel_first_touch())
+    for(ffm_ulong i = 0; i < n; i++) {
+        weights[i*stride] = 0;
 
-        for (ffm_uint d = n_dim_aligned; d < 2*n_dim_aligned; d++, w++)
-            *w = 1;
+        if (stride > 1)
+            weights[i*stride + 1] = 1;
     }
 }
 
+ffm_model::ffm_model(const ffm_model_dims & dims, int seed, bool restricted, float eta, float lambda, ffm_weight_format weight_format, ffm_optimizer optimizer, bool aggregate_updates, bool shard_updates) {
+    if (dims.hash_bits > ffm_hash_bits)
+        throw std::runtime_error(std::string("Model can't use more than ") + std::to_string(ffm_hash_bits) + " hash bits of data");
 
-static void init_lin_weights(ffm_float * weights, ffm_uint n) {
-    ffm_float * w = weights;
-
-    for(ffm_uint i = 0; i < n; i++) {
-        *w++ = 0;
-        *w++ = 1;
-    }
-}
+    n_fields = dims.n_fields;
+    n_features = ffm_ulong(1) << dims.hash_bits;
+    hash_mask = n_features - 1;
+    n_dim = dims.n_dim;
 
-ffm_model::ffm_model(int seed, bool restricted, float eta, float lambda) {
     this->eta = eta;
     this->lambda = lambda;
+    this->weight_format = weight_format;
+    this->optimizer = optimizer;
+    this->aggregate_updates = aggregate_updates || shard_updates; // Owners receive aggregated rows
 
     if (restricted) {
         max_b_field = 29;
@@ -62,172 +59,220 @@ ffm_model::ffm_model(int seed, bool restricted, float eta, float lambda) {
         min_a_field = 0;
     }
 
-    std::default_random_engine rnd(seed);
-
     bias_w = 0;
     bias_wg = 1;
 
-    ffm_weights = malloc_aligned<float>(n_features * n_fields * n_dim_aligned * 2);
-    lin_weights = malloc_aligned<float>(n_features * 2);
+    shards = shard_updates ? new update_shards(dims.hash_bits, n_dim + 1) : nullptr;
+
+    lin_weights = malloc_aligned<float>(n_features * lin_stride());
+    init_lin_weights(lin_weights, n_features, lin_stride());
+
+    ffm_weights = malloc_aligned<char>(ffm_weights_size());
+
+    if (weight_format == ffm_weight_format::int8) {
+        if (optimizer != ffm_optimizer::none)
+            throw std::runtime_error("Int8 weights are supported only by inference-only models");
 
-    init_ffm_weights(ffm_weights, n_features * n_fields, std::uniform_real_distribution<ffm_float>(0.0, 1.0/sqrt(n_dim)), rnd);
-    init_lin_weights(lin_weights, n_features);
+        fill_with_zero((char *) ffm_weights, ffm_weights_size()); // Quantized weights are always loaded
+        return;
+    }
+
+    dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        init_ffm_weights<decltype(w), decltype(o)>((typename decltype(w)::type *) ffm_weights, n_features * n_fields, 0.0, 1.0/sqrt(n_dim), seed);
+    });
 }
 
 ffm_model::~ffm_model() {
-    free(ffm_weights);
-    free(lin_weights);
+    free_aligned(ffm_weights);
+    free_aligned(lin_weights);
+
+    delete shards;
 }
 
 
-uint ffm_model::get_dropout_mask_size(const ffm_feature * start, const ffm_feature * end) {
-    uint feature_count = end - start;
-    uint interaction_count = feature_count * (feature_count + 1) / 2;
+ffm_ulong ffm_model::ffm_weights_size() const {
+    if (weight_format == ffm_weight_format::int8)
+        return dispatch_dim(n_dim, [&](auto n) { return n_features * n_fields * decltype(n)::int8_field_stride; });
 
-    return interaction_count;
+    return dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        return n_features * n_fields * decltype(o)::field_stride * sizeof(typename decltype(w)::type);
+    });
 }
 
 
-ffm_float ffm_model::predict(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult) {
-    ffm_float linear_total = bias_w;
-    ffm_float linear_norm = end - start;
+ffm_ulong ffm_model::lin_stride() const {
+    return optimizer == ffm_optimizer::none ? 1 : 2;
+}
 
-    __m256 xmm_total = _mm256_set1_ps(0);
 
-    ffm_uint i = 0;
+void ffm_model::save(ffm_checkpoint_writer & out) const {
+    out.write(ffm_ulong(n_fields));
+    out.write(n_features);
+    out.write(ffm_ulong(n_dim));
+    out.write(ffm_ulong(aligned_float_array_size(n_dim)));
+    out.write(ffm_uint(weight_format));
+    out.write(ffm_uint(optimizer));
 
-    for (const ffm_feature * fa = start; fa != end; ++ fa) {
-        ffm_uint index_a = fa->index &  ffm_hash_mask;
-        ffm_uint field_a = fa->index >> ffm_hash_bits;
-        ffm_float value_a = fa->value;
+    out.write(eta);
+    out.write(lambda);
+    out.write(max_b_field);
+    out.write(min_a_field);
 
-        linear_total += value_a * lin_weights[index_a*2] / linear_norm;
+    out.write(bias_w);
+    out.write(bias_wg);
 
-        if (field_a < min_a_field)
-            continue;
+    out.write_array((const char *) ffm_weights, ffm_weights_size());
+    out.write_array(lin_weights, n_features * lin_stride());
+}
 
-        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
-            ffm_uint index_b = fb->index &  ffm_hash_mask;
-            ffm_uint field_b = fb->index >> ffm_hash_bits;
-            ffm_float value_b = fb->value;
+void ffm_model::load(ffm_checkpoint_reader & in) {
+    in.expect(ffm_ulong(n_fields), "n_fields");
+    in.expect(n_features, "n_features");
+    in.expect(ffm_ulong(n_dim), "n_dim");
+    in.expect(ffm_ulong(aligned_float_array_size(n_dim)), "n_dim_aligned");
+    in.expect(ffm_uint(weight_format), "weight format");
+    in.expect(ffm_uint(optimizer), "optimizer");
 
-            if (field_b > max_b_field)
-                break;
+    eta = in.read<float>();
+    lambda = in.read<float>();
+    max_b_field = in.read<ffm_uint>();
+    min_a_field = in.read<ffm_uint>();
 
-            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
-                ffm_uint index_p = fb[prefetch_depth].index &  ffm_hash_mask;
-                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+    bias_w = in.read<float>();
+    bias_wg = in.read<float>();
 
-                prefetch_interaction_weights(ffm_weights + index_p * index_stride + field_a * field_stride);
-                prefetch_interaction_weights(ffm_weights + index_a * index_stride + field_p * field_stride);
-            }
+    in.read_array((char *) ffm_weights, ffm_weights_size());
+    in.read_array(lin_weights, n_features * lin_stride());
+}
 
-            if (test_mask_bit(dropout_mask, i) == 0)
-                continue;
 
-            //if (field_a == field_b)
-            //    continue;
+void ffm_model::save_inference(ffm_checkpoint_writer & out, ffm_weight_format format) const {
+    out.write(ffm_ulong(n_fields));
+    out.write(n_features);
+    out.write(ffm_ulong(n_dim));
+    out.write(ffm_ulong(aligned_float_array_size(n_dim)));
+    out.write(ffm_uint(format));
+    out.write(ffm_uint(ffm_optimizer::none));
 
-            ffm_float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
-            ffm_float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+    out.write(eta);
+    out.write(lambda);
+    out.write(max_b_field);
+    out.write(min_a_field);
 
-            __m256 xmm_val = _mm256_set1_ps(dropout_mult * value_a * value_b / norm);
+    out.write(bias_w);
+    out.write(bias_wg);
 
-            for(ffm_uint d = 0; d < n_dim; d += 8) {
-                __m256 xmm_wa = _mm256_load_ps(wa + d);
-                __m256 xmm_wb = _mm256_load_ps(wb + d);
+    // Copy weights of rows without optimizer state, converting them to target format
+    ffm_ulong n_rows = n_features * n_fields;
 
-                xmm_total = _mm256_add_ps(xmm_total, _mm256_mul_ps(_mm256_mul_ps(xmm_wa, xmm_wb), xmm_val));
-            }
-        }
-    }
+    dispatch_kernel(weight_format, optimizer, n_dim, [&](auto w, auto o) {
+        typedef decltype(w) W;
+        typedef decltype(o) O;
 
-    return sum(xmm_total) + linear_total;
-}
+        constexpr ffm_uint n_dim = O::n_dim;
+        constexpr ffm_uint n_dim_aligned = O::n_dim_aligned;
 
+        if (format == ffm_weight_format::int8) {
+            constexpr ffm_ulong int8_field_stride = ffm_dim<n_dim>::int8_field_stride;
+            constexpr ffm_ulong int8_scale_offset = ffm_dim<n_dim>::int8_scale_offset;
 
-void ffm_model::update(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult) {
-    ffm_float linear_norm = end - start;
+            auto src = (const typename W::type *) ffm_weights;
+            auto dst = malloc_aligned<int8_t>(n_rows * int8_field_stride);
 
-    __m256 xmm_eta = _mm256_set1_ps(eta);
-    __m256 xmm_lambda = _mm256_set1_ps(lambda);
+            #pragma omp parallel for schedule(static)
+            for (ffm_ulong i = 0; i < n_rows; ++ i) {
+                float row[n_dim];
+                float max_abs = 0;
 
-    ffm_uint i = 0;
+                for (ffm_uint d = 0; d < n_dim; ++ d) {
+                    row[d] = W::to_float(src[i * O::field_stride + d]);
+                    max_abs = std::max(max_abs, std::abs(row[d]));
+                }
 
-    for (const ffm_feature * fa = start; fa != end; ++ fa) {
-        ffm_uint index_a = fa->index &  ffm_hash_mask;
-        ffm_uint field_a = fa->index >> ffm_hash_bits;
-        ffm_float value_a = fa->value;
+                // Quantize with scale as it's stored, so rounding of scale doesn't add error
+                uint16_t scale = float_to_fp16(max_abs / 127);
+                int8_t * q = dst + i * int8_field_stride;
 
-        ffm_float g = lambda * lin_weights[index_a*2] + kappa * value_a / linear_norm;
-        ffm_float wg = lin_weights[index_a*2 + 1] + g*g;
+                std::fill(q, q + int8_field_stride, 0);
+                quantize_int8(row, n_dim, fp16_to_float(scale), q);
+                memcpy(q + int8_scale_offset, &scale, sizeof(scale));
+            }
 
-        lin_weights[index_a*2] -= eta * g / sqrt(wg);
-        lin_weights[index_a*2 + 1] = wg;
+            out.write_array((const char *) dst, n_rows * int8_field_stride);
 
-        if (field_a < min_a_field)
-            continue;
+            free_aligned(dst);
+            return;
+        }
 
-        for (const ffm_feature * fb = start; fb != fa; ++ fb, ++ i) {
-            ffm_uint index_b = fb->index &  ffm_hash_mask;
-            ffm_uint field_b = fb->index >> ffm_hash_bits;
-            ffm_float value_b = fb->value;
+        dispatch_format(format, [&](auto tw) {
+            typedef decltype(tw) TW;
 
-            if (field_b > max_b_field)
-                break;
+            auto src = (const typename W::type *) ffm_weights;
+            auto dst = malloc_aligned<typename TW::type>(n_rows * n_dim_aligned);
 
-            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, i + prefetch_depth)) { // Prefetch row only if no dropout
-                ffm_uint index_p = fb[prefetch_depth].index &  ffm_hash_mask;
-                ffm_uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+            #pragma omp parallel for schedule(static)
+            for (ffm_ulong i = 0; i < n_rows; ++ i) {
+                for (ffm_uint d = 0; d < n_dim; ++ d)
+                    dst[i * n_dim_aligned + d] = TW::convert(W::to_float(src[i * O::field_stride + d]));
 
-                prefetch_interaction_weights(ffm_weights + index_p * index_stride + field_a * field_stride);
-                prefetch_interaction_weights(ffm_weights + index_a * index_stride + field_p * field_stride);
+                for (ffm_uint d = n_dim; d < n_dim_aligned; ++ d)
+                    dst[i * n_dim_aligned + d] = TW::convert(0);
             }
 
-            if (test_mask_bit(dropout_mask, i) == 0)
-                continue;
+            out.write_array((const char *) dst, n_rows * n_dim_aligned * sizeof(typename TW::type));
 
-            //if (field_a == field_b)
-            //    continue;
+            free_aligned(dst);
+        });
+    });
 
-            ffm_float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
-            ffm_float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+    std::vector<float> lin(n_features);
 
-            ffm_float * wga = wa + n_dim_aligned;
-            ffm_float * wgb = wb + n_dim_aligned;
+    for (ffm_ulong i = 0; i < n_features; ++ i)
+        lin[i] = lin_weights[i * lin_stride()];
 
-            __m256 xmm_kappa_val = _mm256_set1_ps(kappa * dropout_mult * value_a * value_b / norm);
+    out.write_array(lin.data(), n_features);
+}
 
-            for(ffm_uint d = 0; d < n_dim; d += 8) {
-                // Load weights
-                __m256 xmm_wa = _mm256_load_ps(wa + d);
-                __m256 xmm_wb = _mm256_load_ps(wb + d);
 
-                __m256 xmm_wga = _mm256_load_ps(wga + d);
-                __m256 xmm_wgb = _mm256_load_ps(wgb + d);
+uint ffm_model::get_dropout_mask_size(const ffm_feature * start, const ffm_feature * end) {
+    uint feature_count = end - start;
+    uint interaction_count = feature_count * (feature_count + 1) / 2;
 
-                // Compute gradient values
-                __m256 xmm_ga = _mm256_add_ps(_mm256_mul_ps(xmm_lambda, xmm_wa), _mm256_mul_ps(xmm_kappa_val, xmm_wb));
-                __m256 xmm_gb = _mm256_add_ps(_mm256_mul_ps(xmm_lambda, xmm_wb), _mm256_mul_ps(xmm_kappa_val, xmm_wa));
+    return interaction_count;
+}
 
-                // Update weights
-                xmm_wga = _mm256_add_ps(xmm_wga, _mm256_mul_ps(xmm_ga, xmm_ga));
-                xmm_wgb = _mm256_add_ps(xmm_wgb, _mm256_mul_ps(xmm_gb, xmm_gb));
 
-                xmm_wa  = _mm256_sub_ps(xmm_wa, _mm256_mul_ps(xmm_eta, _mm256_mul_ps(_mm256_rsqrt_ps(xmm_wga), xmm_ga)));
-                xmm_wb  = _mm256_sub_ps(xmm_wb, _mm256_mul_ps(xmm_eta, _mm256_mul_ps(_mm256_rsqrt_ps(xmm_wgb), xmm_gb)));
+ffm_float ffm_model::predict(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult) {
+    return dispatch_simd([&](auto v) { return this->predict_simd<typename decltype(v)::type>(start, end, norm, dropout_mask, dropout_mult); });
+}
 
-                // Store weights
-                _mm256_store_ps(wa + d, xmm_wa);
-                _mm256_store_ps(wb + d, xmm_wb);
 
-                _mm256_store_ps(wga + d, xmm_wga);
-                _mm256_store_ps(wgb + d, xmm_wgb);
-            }
-        }
-    }
+void ffm_model::update(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult) {
+    if (optimizer == ffm_optimizer::none)
+        throw std::runtime_error("Inference-only model can't be trained");
+
+    dispatch_simd([&](auto v) { this->update_simd<typename decltype(v)::type>(start, end, norm, kappa, dropout_mask, dropout_mult); });
+}
+
+
+void ffm_model::predict_group(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions) {
+    dispatch_simd([&](auto v) { this->predict_group_simd<typename decltype(v)::type>(examples, n, dropout_mult, predictions); });
+}
+
+
+void ffm_model::merge_thread_updates() {
+    if (aggregate_updates)
+        dispatch_simd([&](auto v) { this->apply_updates_simd<typename decltype(v)::type>(); });
+}
+
+
+void ffm_model::flush_thread_updates() {
+    if (shards == nullptr || uint(omp_get_num_threads()) != shards->size())
+        return;
+
+    uint thread = omp_get_thread_num();
 
-    // Update bias
-    bias_wg += kappa;
-    bias_w -= eta * kappa / sqrt(bias_wg);
+    shards->finish([&]() {
+        dispatch_simd([&](auto v) { this->receive_updates_simd<typename decltype(v)::type>(thread); });
+    });
 }
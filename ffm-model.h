@@ -2,10 +2,24 @@
 
 #include "ffm.h"
 
+// Storage format of interaction weights and their AdaGrad accumulators, half precision ones use stochastic rounding on update,
+// int8 with per-row scale is supported only by inference-only models
+enum class ffm_weight_format { fp32, fp16, bf16, int8 };
+
+class update_shards;
+
 class ffm_model {
-    float * ffm_weights;
+    void * ffm_weights; // In weight_format
     float * lin_weights;
 
+    ffm_uint n_fields;
+    ffm_ulong n_features;
+    ffm_uint hash_mask;
+    ffm_uint n_dim;
+
+    ffm_weight_format weight_format;
+    ffm_optimizer optimizer;
+
     float bias_w;
     float bias_wg;
 
@@ -14,12 +28,80 @@ class ffm_model {
 
     ffm_uint max_b_field;
     ffm_uint min_a_field;
+
+    bool aggregate_updates; // Accumulate gradients of rows over mini-batch and update each touched row once
+    update_shards * shards; // Owners of interaction rows among training threads, if their updates are sharded
 public:
-    ffm_model(int seed, bool restricted, float eta, float lambda);
+    ffm_model(const ffm_model_dims & dims, int seed, bool restricted, float eta, float lambda, ffm_weight_format weight_format = ffm_weight_format::fp32, ffm_optimizer optimizer = ffm_optimizer::adagrad, bool aggregate_updates = false, bool shard_updates = false);
     ~ffm_model();
 
     float predict(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
     void update(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
 
     uint get_dropout_mask_size(const ffm_feature * start, const ffm_feature * end);
+
+    // Apply gradients accumulated by current thread when updates are aggregated, called after each mini-batch
+    void merge_thread_updates();
+
+    // Apply updates queued to owner threads, called by each training thread when it has no more examples in pass,
+    // returns when all threads have finished sending
+    void flush_thread_updates();
+
+    // Batched training is supported only by models with dense layers
+    void predict_batch(ffm_batch_example *, uint, float, float *) { throw std::runtime_error("Batched training is not supported by ffm model"); }
+    void update_batch(const ffm_batch_example *, uint, float) { throw std::runtime_error("Batched training is not supported by ffm model"); }
+
+    // Predict examples of display group, which start with the same event features: interactions among them are computed
+    // once per group, with dropout mask of the first example, and only the rest is computed per example
+    void predict_group(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+
+    void save(ffm_checkpoint_writer & out) const;
+    void load(ffm_checkpoint_reader & in);
+
+    // Save inference-only model, which has weights without optimizer state, converted to given format
+    void save_inference(ffm_checkpoint_writer & out, ffm_weight_format format) const;
+private:
+    ffm_ulong ffm_weights_size() const; // In bytes
+    ffm_ulong lin_stride() const;
+
+    // Kernels for instruction set V, instantiated in its kernel object
+    template <typename V>
+    float predict_simd(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V>
+    void update_simd(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V>
+    void predict_group_simd(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+
+    template <typename V>
+    void apply_updates_simd();
+
+    template <typename V>
+    void receive_updates_simd(uint owner);
+
+    template <typename V, typename N>
+    float predict_int8(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V, typename W, typename O>
+    float predict_impl(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V, typename W, typename O>
+    void update_impl(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V, typename W, typename O>
+    void predict_group_impl(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+
+    // Terms of features from [from, end) and their interactions with preceding features of example, from i-th pair of dropout mask
+    template <typename V, typename W, typename O>
+    typename V::vec predict_features(const ffm_feature * start, const ffm_feature * from, const ffm_feature * end, ffm_uint & i, uint64_t * dropout_mask, float linear_scale, float pair_scale, float & linear_total);
+
+    template <typename V, typename W, typename O>
+    void accumulate_impl(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V, typename W, typename O>
+    void apply_updates_impl();
+
+    template <typename V, typename W, typename O>
+    void receive_updates_impl(uint owner);
 };
@@ -0,0 +1,421 @@
+#include "ffm-nn-model-kernels.h"
+#include "util/nn-helpers.h"
+
+// Prediction and update kernels of ffm-nn model, compiled once per instruction set SIMD_ISA
+
+constexpr uint prefetch_depth = 1;
+
+
+// Local to kernel object, as nn and ffm-nn models have different buffers of the same name
+namespace {
+
+class state_buffer {
+public:
+    float * l0_output;
+    float * l0_output_grad;
+    float * l0_dropout_mask;
+
+    float * l1_output;
+    float * l1_output_grad;
+    float * l1_dropout_mask;
+
+    std::default_random_engine gen;
+public:
+    state_buffer() {
+        l0_output = malloc_aligned<float>(l0_output_size);
+        l0_output_grad = malloc_aligned<float>(l0_output_size);
+        l0_dropout_mask = malloc_aligned<float>(l0_output_size);
+
+        l1_output = malloc_aligned<float>(l1_output_size);
+        l1_output_grad = malloc_aligned<float>(l1_output_size);
+        l1_dropout_mask = malloc_aligned<float>(l1_output_size);
+    }
+
+    ~state_buffer() {
+        free_aligned(l0_output);
+        free_aligned(l0_output_grad);
+        free_aligned(l0_dropout_mask);
+
+        free_aligned(l1_output);
+        free_aligned(l1_output_grad);
+        free_aligned(l1_dropout_mask);
+    }
+
+};
+
+}
+
+static thread_local state_buffer local_state_buffer;
+
+
+// Buffers of batched kernels, matrices with row per mini-batch example
+namespace {
+
+class batch_state_buffer {
+public:
+    float * l0_output;
+    float * l0_output_grad;
+    float * l0_dropout_mask;
+
+    float * l1_output;
+    float * l1_output_grad;
+    float * l1_dropout_mask;
+
+    float * kappas;
+public:
+    batch_state_buffer() {
+        l0_output = malloc_aligned<float>(mini_batch_size * l0_output_size);
+        l0_output_grad = malloc_aligned<float>(mini_batch_size * l0_output_size);
+        l0_dropout_mask = malloc_aligned<float>(mini_batch_size * l0_output_size);
+
+        l1_output = malloc_aligned<float>(mini_batch_size * l1_output_size);
+        l1_output_grad = malloc_aligned<float>(mini_batch_size * l1_output_size);
+        l1_dropout_mask = malloc_aligned<float>(mini_batch_size * l1_output_size);
+
+        kappas = malloc_aligned<float>(mini_batch_size);
+    }
+
+    ~batch_state_buffer() {
+        free_aligned(l0_output);
+        free_aligned(l0_output_grad);
+        free_aligned(l0_dropout_mask);
+
+        free_aligned(l1_output);
+        free_aligned(l1_output_grad);
+        free_aligned(l1_dropout_mask);
+
+        free_aligned(kappas);
+    }
+};
+
+}
+
+static thread_local batch_state_buffer local_batch_state_buffer;
+
+template <typename O>
+inline void prefetch_interaction_weights(float * addr) {
+    for (uint i = 0, sz = O::field_stride * sizeof(float); i < sz; i += 64)
+        _mm_prefetch(((char *)addr) + i, _MM_HINT_T1);
+}
+
+
+template <typename V>
+float ffm_nn_model::predict_simd(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult) {
+    float * l0_output = local_state_buffer.l0_output;
+    float * l0_dropout_mask = local_state_buffer.l0_dropout_mask;
+
+    float * l1_output = local_state_buffer.l1_output;
+    float * l1_dropout_mask = local_state_buffer.l1_dropout_mask;
+
+    auto & gen = local_state_buffer.gen;
+
+    if (optimizer == ffm_optimizer::row_adagrad)
+        embed_impl<V, ffm_row_adagrad>(start, end, norm, dropout_mask, dropout_mult, l0_output);
+    else
+        embed_impl<V, ffm_adagrad>(start, end, norm, dropout_mask, dropout_mult, l0_output);
+
+    // Prepare dropout masks, applied only in train
+    fill_dropout_mask(l0_dropout_mask, l0_output_size, 0, dropout_mult, gen);
+    fill_dropout_mask(l1_dropout_mask, l1_output_size, 0, dropout_mult, gen);
+
+    // Layer 0 relu
+    l0_output[0] = 1.0; // Layer 1 bias
+    for (uint j = 1; j < l0_output_size; ++ j)
+        l0_output[j] = relu(l0_output[j]) * l0_dropout_mask[j];
+
+    // Dense layers, copies of current thread when they are replicated
+    float * const * dense_layers = dense->read_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l2_w = dense_layers[2];
+
+    // Layer 1 forward pass
+    l1_output[0] = 1.0; // Layer 2 bias
+    for (uint j = 1; j < l1_output_size; ++ j)
+        l1_output[j] = relu(forward_pass<V>(l0_output_size, l0_output, l1_w + (j - 1) * l0_output_size)) * l1_dropout_mask[j];
+
+    // Layer 2 forward pass
+    return forward_pass<V>(l1_output_size, l1_output, l2_w);
+}
+
+
+template <typename V>
+void ffm_nn_model::update_simd(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult) {
+    float * l0_output = local_state_buffer.l0_output;
+    float * l0_output_grad = local_state_buffer.l0_output_grad;
+    float * l0_dropout_mask = local_state_buffer.l0_dropout_mask;
+
+    float * l1_output = local_state_buffer.l1_output;
+    float * l1_output_grad = local_state_buffer.l1_output_grad;
+    float * l1_dropout_mask = local_state_buffer.l1_dropout_mask;
+
+    fill_with_zero(l0_output_grad, l0_output_size);
+    fill_with_zero(l1_output_grad, l1_output_size);
+
+    float * const * dense_layers = dense->update_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l1_wg = dense_layers[1];
+    float * l2_w = dense_layers[2];
+    float * l2_wg = dense_layers[3];
+
+    // Backprop layer 2
+    backward_pass<V>(l1_output_size, l1_output, l1_output_grad, l2_w, l2_wg, kappa, eta, nn_lambda);
+
+    // Backprop layer 1
+    for (uint j = 1, ofs = 0; j < l1_output_size; ++ j, ofs += l0_output_size) {
+        float l1_grad = l1_output_grad[j] * l1_dropout_mask[j];
+
+        if (l1_output[j] <= 0) // Relu activation: grad in negative part is zero
+            l1_grad = 0;
+
+        backward_pass<V>(l0_output_size, l0_output, l0_output_grad, l1_w + ofs, l1_wg + ofs, l1_grad, eta, nn_lambda);
+    }
+
+    // Backprop layer 0
+    l0_output_grad[0] = 0;
+    for (uint j = 1; j < l0_output_size; ++ j) {
+        float l0_grad = l0_output_grad[j] * l0_dropout_mask[j];
+
+        if (l0_output[j] <= 0) // Relu activation: grad in negative part is zero
+            l0_grad = 0;
+
+        l0_output_grad[j] = l0_grad;
+    }
+
+    // Update linear and interaction weights
+    if (optimizer == ffm_optimizer::row_adagrad)
+        update_embeddings_impl<V, ffm_row_adagrad>(start, end, norm, l0_output_grad, dropout_mask, dropout_mult);
+    else
+        update_embeddings_impl<V, ffm_adagrad>(start, end, norm, l0_output_grad, dropout_mask, dropout_mult);
+}
+
+
+template <typename V>
+void ffm_nn_model::predict_batch_simd(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions) {
+    batch_state_buffer & buf = local_batch_state_buffer;
+    auto & gen = local_state_buffer.gen;
+
+    // Embeddings and dropout masks of each example, in the same order as unbatched kernels take them
+    for (uint i = 0; i < n; ++ i) {
+        const ffm_batch_example & ex = examples[i];
+        float * l0_output = buf.l0_output + i * l0_output_size;
+
+        if (optimizer == ffm_optimizer::row_adagrad)
+            embed_impl<V, ffm_row_adagrad>(ex.start, ex.end, ex.norm, ex.dropout_mask, dropout_mult, l0_output);
+        else
+            embed_impl<V, ffm_adagrad>(ex.start, ex.end, ex.norm, ex.dropout_mask, dropout_mult, l0_output);
+
+        fill_dropout_mask(buf.l0_dropout_mask + i * l0_output_size, l0_output_size, 0, dropout_mult, gen);
+        fill_dropout_mask(buf.l1_dropout_mask + i * l1_output_size, l1_output_size, 0, dropout_mult, gen);
+    }
+
+    activate_batch(n, l0_output_size, buf.l0_output, buf.l0_dropout_mask);
+
+    float * const * dense_layers = dense->read_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l2_w = dense_layers[2];
+
+    // Dense layers as matrix products, outputs after bias column
+    forward_pass_batch<V>(n, l0_output_size, buf.l0_output, l1_output_size - 1, l1_w, buf.l1_output + 1, l1_output_size);
+    activate_batch(n, l1_output_size, buf.l1_output, buf.l1_dropout_mask);
+
+    forward_pass_batch<V>(n, l1_output_size, buf.l1_output, 1, l2_w, predictions, 1);
+}
+
+
+template <typename V>
+void ffm_nn_model::update_batch_simd(const ffm_batch_example * examples, uint n, float dropout_mult) {
+    batch_state_buffer & buf = local_batch_state_buffer;
+
+    for (uint i = 0; i < n; ++ i)
+        buf.kappas[i] = examples[i].kappa;
+
+    fill_with_zero(buf.l0_output_grad, n * l0_output_size);
+    fill_with_zero(buf.l1_output_grad, n * l1_output_size);
+
+    float * const * dense_layers = dense->update_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l1_wg = dense_layers[1];
+    float * l2_w = dense_layers[2];
+    float * l2_wg = dense_layers[3];
+
+    // Backprop dense layers with single update of their weights per mini-batch
+    backward_pass_batch<V>(n, l1_output_size, buf.l1_output, buf.l1_output_grad, 1, buf.kappas, 1, l2_w, l2_wg, eta, nn_lambda);
+
+    activate_grad_batch(n, l1_output_size, buf.l1_output, buf.l1_output_grad, buf.l1_dropout_mask);
+    backward_pass_batch<V>(n, l0_output_size, buf.l0_output, buf.l0_output_grad, l1_output_size - 1, buf.l1_output_grad + 1, l1_output_size, l1_w, l1_wg, eta, nn_lambda);
+
+    activate_grad_batch(n, l0_output_size, buf.l0_output, buf.l0_output_grad, buf.l0_dropout_mask);
+
+    // Linear and interaction weights of each example
+    for (uint i = 0; i < n; ++ i) {
+        const ffm_batch_example & ex = examples[i];
+        const float * l0_output_grad = buf.l0_output_grad + i * l0_output_size;
+
+        if (optimizer == ffm_optimizer::row_adagrad)
+            update_embeddings_impl<V, ffm_row_adagrad>(ex.start, ex.end, ex.norm, l0_output_grad, ex.dropout_mask, dropout_mult);
+        else
+            update_embeddings_impl<V, ffm_adagrad>(ex.start, ex.end, ex.norm, l0_output_grad, ex.dropout_mask, dropout_mult);
+    }
+}
+
+
+template <typename V, typename O>
+void ffm_nn_model::embed_impl(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult, float * l0_output) {
+    typedef typename V::vec vec;
+
+    constexpr ffm_ulong field_stride = O::field_stride;
+    constexpr uint span = V::span(n_dim);
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    float linear_norm = end - start;
+
+    fill_with_zero(l0_output, l0_output_size);
+
+    uint dropout_idx = 0;
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        uint index_a = fa->index & hash_mask;
+        uint field_a = fa->index >> ffm_hash_bits;
+        float value_a = fa->value;
+
+        {
+            float * wl = lin_weights + index_a * lin_stride;
+
+            vec v_val = V::set1(value_a / linear_norm);
+            for(uint d = 0; d < span; d += V::width) {
+                uint n = simd_lanes<V>(d, span);
+
+                V::store(l0_output + d,  V::fmadd(V::load(wl + d, n), v_val, V::load(l0_output + d, n)), n);
+            }
+        }
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb) {
+            uint index_b = fb->index & hash_mask;
+            uint field_b = fb->index >> ffm_hash_bits;
+            float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, dropout_idx + prefetch_depth)) { // Prefetch row only if no dropout
+                uint index_p = fb[prefetch_depth].index & hash_mask;
+                uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                prefetch_interaction_weights<O>(ffm_weights + index_p * index_stride + field_a * field_stride);
+                prefetch_interaction_weights<O>(ffm_weights + index_a * index_stride + field_p * field_stride);
+            }
+
+            if (test_mask_bit(dropout_mask, dropout_idx ++) == 0)
+                continue;
+
+            float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
+            float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+
+            vec v_val = V::set1(dropout_mult * value_a * value_b / norm);
+
+            for(uint d = 0; d < span; d += V::width) {
+                uint n = simd_lanes<V>(d, span);
+
+                vec v_wa = V::load(wa + d, n);
+                vec v_wb = V::load(wb + d, n);
+
+                V::store(l0_output + d,  V::fmadd(O::template mask_weights<V>(v_wa * v_wb, d), v_val, V::load(l0_output + d, n)), n);
+            }
+        }
+    }
+}
+
+
+template <typename V, typename O>
+void ffm_nn_model::update_embeddings_impl(const ffm_feature * start, const ffm_feature * end, float norm, const float * l0_output_grad, uint64_t * dropout_mask, float dropout_mult) {
+    typedef typename V::vec vec;
+
+    constexpr ffm_ulong field_stride = O::field_stride;
+    constexpr uint span = V::span(n_dim);
+
+    const ffm_ulong index_stride = n_fields * field_stride;
+
+    float linear_norm = end - start;
+
+    vec v_eta = V::set1(eta);
+    vec v_ffm_lambda = V::set1(ffm_lambda);
+
+    // Update linear and interaction weights
+    uint dropout_idx = 0;
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        uint index_a = fa->index & hash_mask;
+        uint field_a = fa->index >> ffm_hash_bits;
+        float value_a = fa->value;
+
+        {
+            float * wl = lin_weights + index_a * lin_stride;
+            float * wgl = wl + n_dim_aligned;
+
+            vec v_val = V::set1(value_a / linear_norm);
+
+            for (uint d = 0; d < span; d += V::width) {
+                uint n = simd_lanes<V>(d, span);
+
+                vec v_kappa_val = V::load(l0_output_grad + d, n) * v_val;
+
+                // Load weights
+                vec v_wl = V::load(wl + d, n);
+                vec v_wgl = V::load(wgl + d, n);
+
+                // Compute gradient values
+                vec v_g  = V::fmadd(v_ffm_lambda, v_wl, v_kappa_val);
+
+                // Update weights
+                v_wgl = V::fmadd(v_g, v_g, v_wgl);
+                v_wl  = V::fnmadd(v_eta * v_g, V::rsqrt(v_wgl), v_wl);
+
+                // Store weights
+                V::store(wl + d, v_wl, n);
+                V::store(wgl + d, v_wgl, n);
+            }
+        }
+
+        if (field_a < min_a_field)
+            continue;
+
+        for (const ffm_feature * fb = start; fb != fa; ++ fb) {
+            uint index_b = fb->index & hash_mask;
+            uint field_b = fb->index >> ffm_hash_bits;
+            float value_b = fb->value;
+
+            if (field_b > max_b_field)
+                break;
+
+            if (fb + prefetch_depth < fa && test_mask_bit(dropout_mask, dropout_idx + prefetch_depth)) { // Prefetch row only if no dropout
+                uint index_p = fb[prefetch_depth].index & hash_mask;
+                uint field_p = fb[prefetch_depth].index >> ffm_hash_bits;
+
+                prefetch_interaction_weights<O>(ffm_weights + index_p * index_stride + field_a * field_stride);
+                prefetch_interaction_weights<O>(ffm_weights + index_a * index_stride + field_p * field_stride);
+            }
+
+            if (test_mask_bit(dropout_mask, dropout_idx ++) == 0)
+                continue;
+
+            float * wa = ffm_weights + index_a * index_stride + field_b * field_stride;
+            float * wb = ffm_weights + index_b * index_stride + field_a * field_stride;
+
+            vec v_val = V::set1(dropout_mult * value_a * value_b / norm);
+
+            O::template update<V>(wa, wb, l0_output_grad, v_val, v_ffm_lambda, v_eta);
+        }
+    }
+}
+
+
+template float ffm_nn_model::predict_simd<SIMD_ISA>(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+template void ffm_nn_model::update_simd<SIMD_ISA>(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+template void ffm_nn_model::predict_batch_simd<SIMD_ISA>(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+template void ffm_nn_model::update_batch_simd<SIMD_ISA>(const ffm_batch_example * examples, uint n, float dropout_mult);
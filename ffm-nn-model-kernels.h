@@ -0,0 +1,137 @@
+#pragma once
+
+#include "ffm-nn-model.h"
+#include "util/model-helpers.h"
+#include "util/simd.h"
+
+// Layer sizes and row layouts of ffm-nn model, vector parts are templates on instruction set V
+// and are instantiated only in kernel objects
+
+
+constexpr ffm_ulong n_dim = 16; // Fixed, as it's the input size of dense layers
+constexpr ffm_ulong n_dim_aligned = aligned_float_array_size(n_dim);
+
+constexpr ffm_ulong lin_stride = n_dim_aligned * 2;
+
+constexpr uint interaction_output_size = 50;
+
+constexpr uint l0_output_size = n_dim_aligned;
+constexpr uint l1_output_size = aligned_float_array_size(24);
+
+constexpr uint l1_layer_size = l0_output_size * (l1_output_size - 1);
+constexpr uint l2_layer_size = l1_output_size;
+
+
+// Optimizers of interaction weights, define row layout and update of pair of rows with per-coordinate output gradient
+
+// Accumulator per coordinate, stored in second half of row
+struct ffm_adagrad {
+    static constexpr ffm_ulong field_stride = n_dim_aligned * 2;
+
+    // Initial value of row element after weights
+    static float initial_state(ffm_uint d) { return d >= n_dim_aligned ? 1 : 0; }
+
+    // Zero row elements which are not weights in block starting at d
+    template <typename V>
+    static typename V::vec mask_weights(typename V::vec v, ffm_uint) { return v; }
+
+    template <typename V>
+    static void update(float * wa, float * wb, const float * output_grad, typename V::vec v_val, typename V::vec v_ffm_lambda, typename V::vec v_eta) {
+        typedef typename V::vec vec;
+
+        constexpr uint span = V::span(n_dim);
+
+        float * wga = wa + n_dim_aligned;
+        float * wgb = wb + n_dim_aligned;
+
+        for (uint d = 0; d < span; d += V::width) {
+            uint n = simd_lanes<V>(d, span);
+
+            vec v_kappa_val = V::load(output_grad + d, n) * v_val;
+
+            // Load weights
+            vec v_wa = V::load(wa + d, n);
+            vec v_wb = V::load(wb + d, n);
+
+            vec v_wga = V::load(wga + d, n);
+            vec v_wgb = V::load(wgb + d, n);
+
+            // Compute gradient values
+            vec v_ga = V::fmadd(v_ffm_lambda, v_wa, v_kappa_val * v_wb);
+            vec v_gb = V::fmadd(v_ffm_lambda, v_wb, v_kappa_val * v_wa);
+
+            // Update weights
+            v_wga = V::fmadd(v_ga, v_ga, v_wga);
+            v_wgb = V::fmadd(v_gb, v_gb, v_wgb);
+
+            v_wa = V::fnmadd(v_eta * v_ga, V::rsqrt(v_wga), v_wa);
+            v_wb = V::fnmadd(v_eta * v_gb, V::rsqrt(v_wgb), v_wb);
+
+            // Store weights
+            V::store(wa + d, v_wa, n);
+            V::store(wb + d, v_wb, n);
+
+            V::store(wga + d, v_wga, n);
+            V::store(wgb + d, v_wgb, n);
+        }
+    }
+};
+
+// Single accumulator of mean squared gradient per row, stored in element n_dim right after weights
+struct ffm_row_adagrad {
+    static constexpr ffm_ulong field_stride = aligned_float_array_size(n_dim + 1);
+
+    static float initial_state(ffm_uint d) { return d == n_dim ? 1 : 0; }
+
+    template <typename V>
+    static typename V::vec mask_weights(typename V::vec v, ffm_uint d) {
+        return d + V::width > n_dim ? V::mask_below(v, n_dim, d) : v;
+    }
+
+    template <typename V>
+    static void update(float * wa, float * wb, const float * output_grad, typename V::vec v_val, typename V::vec v_ffm_lambda, typename V::vec v_eta) {
+        typedef typename V::vec vec;
+
+        constexpr uint span = V::span(n_dim);
+        constexpr uint n_blocks = (span + V::width - 1) / V::width;
+
+        vec v_ga[n_blocks], v_gb[n_blocks];
+
+        vec v_ssa = V::zero();
+        vec v_ssb = V::zero();
+
+        // Compute gradients of weights
+        for (uint b = 0, d = 0; d < span; b ++, d += V::width) {
+            uint n = simd_lanes<V>(d, span);
+
+            vec v_kappa_val = V::load(output_grad + d, n) * v_val;
+
+            vec v_wa = V::load(wa + d, n);
+            vec v_wb = V::load(wb + d, n);
+
+            v_ga[b] = mask_weights<V>(V::fmadd(v_ffm_lambda, v_wa, v_kappa_val * v_wb), d);
+            v_gb[b] = mask_weights<V>(V::fmadd(v_ffm_lambda, v_wb, v_kappa_val * v_wa), d);
+
+            v_ssa = V::fmadd(v_ga[b], v_ga[b], v_ssa);
+            v_ssb = V::fmadd(v_gb[b], v_gb[b], v_ssb);
+        }
+
+        // Update accumulators
+        float wga = wa[n_dim] + V::sum(v_ssa) / n_dim;
+        float wgb = wb[n_dim] + V::sum(v_ssb) / n_dim;
+
+        wa[n_dim] = wga;
+        wb[n_dim] = wgb;
+
+        vec v_rate_a = v_eta * V::set1(1 / sqrt(wga));
+        vec v_rate_b = v_eta * V::set1(1 / sqrt(wgb));
+
+        // Update weights, zero gradient keeps accumulator lane intact
+        for (uint b = 0, d = 0; d < span; b ++, d += V::width) {
+            uint n = simd_lanes<V>(d, span);
+
+            V::store(wa + d, V::fnmadd(v_rate_a, v_ga[b], V::load(wa + d, n)), n);
+            V::store(wb + d, V::fnmadd(v_rate_b, v_gb[b], V::load(wb + d, n)), n);
+        }
+    }
+};
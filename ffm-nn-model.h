@@ -2,6 +2,8 @@
 
 #include "ffm.h"
 
+class dense_replicas;
+
 class ffm_nn_model {
     float * ffm_weights;
     float * lin_weights;
@@ -12,15 +14,61 @@ class ffm_nn_model {
     float * l2_w;
     float * l2_wg;
 
+    dense_replicas * dense; // Per-thread copies of dense layers in training, if enabled
+
     float eta, ffm_lambda, nn_lambda;
 
     uint max_b_field, min_a_field;
+
+    ffm_uint n_fields;
+    ffm_ulong n_features;
+    ffm_uint hash_mask;
+
+    ffm_optimizer optimizer;
 public:
-    ffm_nn_model(int seed, bool restricted, float eta, float ffm_lambda, float nn_lambda);
+    ffm_nn_model(const ffm_model_dims & dims, int seed, bool restricted, float eta, float ffm_lambda, float nn_lambda, ffm_optimizer optimizer = ffm_optimizer::adagrad, bool replicate_dense = false);
     ~ffm_nn_model();
 
     ffm_float predict(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
     void update(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
 
+    // Predict whole mini-batch with dense layers as matrix products, and update with single step of dense weights
+    // by gradients of all examples, given in their kappa after prediction
+    void predict_batch(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+    void update_batch(const ffm_batch_example * examples, uint n, float dropout_mult);
+
+    // Group-shared prediction is supported only by ffm model
+    void predict_group(ffm_batch_example *, uint, float, float *) { throw std::runtime_error("Group-shared prediction is not supported by ffm-nn model"); }
+
     uint get_dropout_mask_size(const ffm_feature * start, const ffm_feature * end);
+
+    // Merge changes made by current thread since last call into shared weights, called after each mini-batch
+    void merge_thread_updates();
+
+    void flush_thread_updates() {} // Nothing is queued between threads
+
+    void save(ffm_checkpoint_writer & out) const;
+    void load(ffm_checkpoint_reader & in);
+private:
+    ffm_ulong ffm_weights_size() const; // In floats
+
+    // Kernels for instruction set V, instantiated in its kernel object
+    template <typename V>
+    ffm_float predict_simd(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V>
+    void update_simd(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V>
+    void predict_batch_simd(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+
+    template <typename V>
+    void update_batch_simd(const ffm_batch_example * examples, uint n, float dropout_mult);
+
+    // Linear and interaction embedding of example, which is layer 0 output before activation, and its update by output gradient
+    template <typename V, typename O>
+    void embed_impl(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult, float * l0_output);
+
+    template <typename V, typename O>
+    void update_embeddings_impl(const ffm_feature * start, const ffm_feature * end, float norm, const float * l0_output_grad, uint64_t * dropout_mask, float dropout_mult);
 };
@@ -0,0 +1,165 @@
+#include "ffm-reader.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+static void read_data(int fd, void * data, ffm_ulong size, ffm_ulong offset) {
+    char * ptr = (char *) data;
+
+    while (size > 0) {
+        ssize_t res = pread(fd, ptr, size, offset);
+
+        if (res <= 0)
+            throw std::runtime_error("Can't read data");
+
+        ptr += res;
+        size -= res;
+        offset += res;
+    }
+}
+
+
+ffm_batch_reader::ffm_batch_reader(const ffm_index & index, const std::string & data_file_name, const ffm_feature * data, const ffm_data_map * data_map, const ffm_batch_list & batches, uint n_buffers, uint n_threads):
+    index(index), batches(batches), data(data), data_map(data_map), buffers(n_buffers), next_batch(0), processed_batches(0), stopped(false), wait_seconds(0)
+{
+    if (data_map != nullptr) {
+        if (data_map->size() < index.offsets[index.size])
+            throw std::runtime_error(std::string("Data file ") + data_file_name + " is smaller than index");
+
+        data_map->advise_sequential(std::is_sorted(batches.begin(), batches.end()));
+    }
+
+    ffm_ulong max_batch_size = 0;
+
+    for (auto b = batches.begin(); b != batches.end(); ++ b)
+        max_batch_size = std::max(max_batch_size, index.offsets[b->second] - index.offsets[b->first]);
+
+    // Allocate all buffers upfront, so they are reused without reallocation
+    for (uint i = 0; i < n_buffers; ++ i) {
+        if (data == nullptr)
+            buffers[i].resize(max_batch_size);
+
+        free_buffers.push_back(i);
+    }
+
+    for (uint i = 0; i < n_threads; ++ i)
+        threads.emplace_back(&ffm_batch_reader::read_batches, this, data_file_name);
+}
+
+
+ffm_batch_reader::~ffm_batch_reader() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+    }
+
+    buffer_released.notify_all();
+
+    for (auto t = threads.begin(); t != threads.end(); ++ t)
+        t->join();
+}
+
+
+bool ffm_batch_reader::next(ffm_batch & batch) {
+    auto wait_start = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    batch_ready.wait(lock, [this] { return !ready_batches.empty() || error || processed_batches >= batches.size(); });
+
+    wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - wait_start).count();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    if (ready_batches.empty())
+        return false;
+
+    batch = ready_batches.front();
+    ready_batches.pop_front();
+
+    // Wake up other workers to let them finish
+    if (++ processed_batches >= batches.size())
+        batch_ready.notify_all();
+
+    return true;
+}
+
+
+void ffm_batch_reader::release(const ffm_batch & batch) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        free_buffers.push_back(batch.buffer);
+    }
+
+    buffer_released.notify_one();
+}
+
+
+void ffm_batch_reader::read_batches(const std::string & data_file_name) {
+    int fd = -1;
+
+    try {
+        if (data == nullptr) {
+            fd = open(data_file_name.c_str(), O_RDONLY);
+
+            if (fd < 0)
+                throw std::runtime_error(std::string("Can't open data file ") + data_file_name);
+        }
+
+        while (true) {
+            ffm_batch batch;
+
+            // Wait for free buffer and take next batch
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                buffer_released.wait(lock, [this] { return stopped || !free_buffers.empty() || next_batch >= batches.size(); });
+
+                if (stopped || next_batch >= batches.size())
+                    break;
+
+                batch.index = next_batch ++;
+                batch.buffer = free_buffers.back();
+                free_buffers.pop_back();
+            }
+
+            batch.start = batches[batch.index].first;
+            batch.end = batches[batch.index].second;
+
+            ffm_ulong from = index.offsets[batch.start];
+            ffm_ulong to = index.offsets[batch.end];
+
+            if (data != nullptr) {
+                // Start reading batch pages, so they are in memory by the time worker gets the batch
+                if (data_map != nullptr)
+                    data_map->advise_willneed(from, to);
+
+                batch.features = data + from;
+            } else {
+                ffm_feature * buffer = buffers[batch.buffer].data();
+                read_data(fd, buffer, (to - from) * sizeof(ffm_feature), from * sizeof(ffm_feature));
+
+                batch.features = buffer;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ready_batches.push_back(batch);
+            }
+
+            batch_ready.notify_one();
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+    }
+
+    batch_ready.notify_all();
+
+    if (fd >= 0)
+        close(fd);
+}
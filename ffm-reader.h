@@ -0,0 +1,64 @@
+#pragma once
+
+#include "ffm.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+
+typedef std::vector<std::pair<ffm_ulong, ffm_ulong>> ffm_batch_list;
+
+
+// Batch of examples handed to worker
+struct ffm_batch {
+    ffm_ulong index; // Position of batch in schedule
+    ffm_ulong start, end; // Range of examples
+
+    const ffm_feature * features; // Features of examples, starting from offsets[start]
+
+    uint buffer; // Buffer holding batch data
+};
+
+
+// Reads scheduled batches in dedicated io threads into pool of reusable buffers and passes them to workers,
+// for in-memory data buffers only limit number of batches requested ahead of workers
+class ffm_batch_reader {
+    const ffm_index & index;
+    const ffm_batch_list & batches;
+    const ffm_feature * data; // If given (mapped or cached data), batches are views into it instead of buffer copies
+    const ffm_data_map * data_map; // If given, used to hint kernel about batches to read
+
+    std::vector<std::vector<ffm_feature>> buffers;
+    std::vector<uint> free_buffers;
+    std::deque<ffm_batch> ready_batches;
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable buffer_released, batch_ready;
+
+    ffm_ulong next_batch; // Next batch to read
+    ffm_ulong processed_batches; // Batches passed to workers
+    bool stopped;
+
+    std::exception_ptr error;
+
+    double wait_seconds;
+public:
+    ffm_batch_reader(const ffm_index & index, const std::string & data_file_name, const ffm_feature * data, const ffm_data_map * data_map, const ffm_batch_list & batches, uint n_buffers, uint n_threads);
+    ~ffm_batch_reader();
+
+    // Get next read batch, blocks until one is available, returns false when all batches are processed
+    bool next(ffm_batch & batch);
+
+    // Return batch buffer to pool
+    void release(const ffm_batch & batch);
+
+    // Total time workers spent waiting for data
+    double wait_time() const { return wait_seconds; }
+private:
+    void read_batches(const std::string & data_file_name);
+};
@@ -4,27 +4,44 @@
 #include "ffm-nn-model.h"
 #include "ftrl-model.h"
 #include "nn-model.h"
+#include "dropout.h"
+
+#include "ffm-reader.h"
+
+#include "util/alloc.h"
+#include "util/random.h"
+#include "util/numa.h"
+#include "util/simd.h"
 
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <random>
 #include <algorithm>
+#include <memory>
+#include <limits>
+
+#include <unistd.h>
 
-#include <immintrin.h>
 #include <omp.h>
 
 #include <boost/program_options.hpp>
 
 // Batch configuration
-const ffm_uint batch_size = 20000;
-const ffm_uint mini_batch_size = 24;
+const ffm_uint batch_size = 20000; // Average number of examples in batch, actual size depends on example costs
+bool batch_dense = false; // Train models with dense layers on whole mini-batches
+bool share_group_features = false; // Predict interactions of event features once per display group
 
-// Dropout configuration
-const ffm_uint dropout_mask_max_size = 4000; // in 64-bit words
+const ffm_uint tail_batches_per_thread = 2; // Number of batches at the end of schedule split into smaller ones
+const ffm_uint tail_batch_parts = 4;
 
+// Reader configuration
+uint io_threads = 1;
+uint prefetch_batches = 4; // Number of batches read ahead of workers
+bool map_data = false; // Use memory-mapped data files instead of reading
 
-std::default_random_engine rnd(2017);
+// Dropout configuration
+const ffm_uint dropout_mask_max_size = 4000; // in 64-bit words, should be multiple of 4
 
 
 template <typename T>
@@ -32,26 +49,98 @@ T min(T a, T b) {
     return a < b ? a : b;
 }
 
+struct ffm_eval_result {
+    ffm_double loss; // Average loss
+    ffm_double map;
+};
+
+
 struct ffm_dataset {
     ffm_index index;
     std::string data_file_name;
+    std::shared_ptr<ffm_data_map> data_map;
+
+    const ffm_feature * features = nullptr; // In-memory features if dataset is mapped or cached
 };
 
 
+std::unique_ptr<ffm_batch_reader> open_batch_reader(const ffm_dataset & dataset, const ffm_batch_list & batches) {
+    // Each worker holds one buffer while processing, others are filled ahead
+    uint n_buffers = omp_get_max_threads() + prefetch_batches;
+
+    return std::unique_ptr<ffm_batch_reader>(new ffm_batch_reader(dataset.index, dataset.data_file_name, dataset.features, dataset.data_map.get(), batches, n_buffers, io_threads));
+}
 
-std::vector<std::pair<ffm_ulong, ffm_ulong>> generate_batches(const ffm_index & index, bool shuffle) {
-    std::vector<std::pair<ffm_ulong, ffm_ulong>> batches;
 
-    for (ffm_ulong batch_start = 0; batch_start < index.size; batch_start += batch_size)
-        batches.push_back(std::make_pair(batch_start, min(batch_start + batch_size, index.size)));
 
-    if (shuffle)
-        std::shuffle(batches.begin(), batches.end(), rnd);
+// Estimated cost of processing example, feature interactions are quadratic in feature count
+inline ffm_ulong example_cost(const ffm_index & index, ffm_ulong i) {
+    ffm_ulong n = index.offsets[i + 1] - index.offsets[i];
+    return n * n + 1;
+}
+
+
+// Split example range into batches with approximately target cost each
+void split_batches(const ffm_index & index, ffm_ulong begin, ffm_ulong end, ffm_ulong target_cost, ffm_batch_list & batches) {
+    ffm_ulong batch_start = begin;
+    ffm_ulong batch_cost = 0;
+
+    for (ffm_ulong i = begin; i < end; ++ i) {
+        batch_cost += example_cost(index, i);
+
+        if (batch_cost >= target_cost) {
+            batches.push_back(std::make_pair(batch_start, i + 1));
+            batch_start = i + 1;
+            batch_cost = 0;
+        }
+    }
+
+    if (batch_start < end)
+        batches.push_back(std::make_pair(batch_start, end));
+}
+
+
+ffm_batch_list generate_batches(const ffm_index & index, bool shuffle, uint64_t seed = 0) {
+    ffm_batch_list batches;
+
+    ffm_ulong total_cost = 0;
+    for (ffm_ulong i = 0; i < index.size; ++ i)
+        total_cost += example_cost(index, i);
+
+    ffm_ulong n_batches = (index.size + batch_size - 1) / batch_size;
+    ffm_ulong target_cost = total_cost / std::max<ffm_ulong>(n_batches, 1) + 1;
+
+    split_batches(index, 0, index.size, target_cost, batches);
+
+    if (shuffle) {
+        xoshiro256 gen(seed);
+        std::shuffle(batches.begin(), batches.end(), gen);
+    }
+
+    // Split last batches into smaller ones, so threads finish epoch at nearly the same time
+    ffm_ulong n_tail = std::min<ffm_ulong>(batches.size(), omp_get_max_threads() * tail_batches_per_thread);
+    ffm_batch_list tail(batches.end() - n_tail, batches.end());
+
+    batches.resize(batches.size() - n_tail);
+
+    for (auto b = tail.begin(); b != tail.end(); ++ b)
+        split_batches(index, b->first, b->second, target_cost / tail_batch_parts + 1, batches);
 
     return batches;
 }
 
 
+// End of run of examples from begin with the same group, at most mini-batch and not past end
+ffm_ulong group_end(const ffm_index & index, ffm_ulong begin, ffm_ulong end) {
+    ffm_ulong i = begin + 1;
+
+    while (i < end && i - begin < mini_batch_size && index.groups[i] == index.groups[begin])
+        ++ i;
+
+    return i;
+}
+
+
 std::vector<std::pair<ffm_ulong, ffm_ulong>> generate_mini_batches(ffm_ulong begin, ffm_ulong end) {
     std::vector<std::pair<ffm_ulong, ffm_ulong>> batches;
 
@@ -62,20 +151,6 @@ std::vector<std::pair<ffm_ulong, ffm_ulong>> generate_mini_batches(ffm_ulong beg
 }
 
 
-void fill_mask_rand(uint64_t * mask, int size, int zero_prob_log) {
-    memset(mask, 0, size * sizeof(uint64_t));
-
-    for (int p = 0; p < size; ++ p) {
-        for (int i = 0; i < zero_prob_log; ++ i) {
-            long long unsigned int v;
-            if (_rdrand64_step(&v) != 1)
-                throw std::runtime_error("Error generating random number!");
-
-            mask[p] |= v;
-        }
-    }
-}
-
 void fill_mask_ones(uint64_t * mask, int size) {
     memset(mask, 0xFF, size * sizeof(uint64_t));
 }
@@ -131,7 +206,7 @@ ffm_double compute_map(const ffm_index & index, const std::vector<ffm_float> & p
 
 
 template <typename M>
-ffm_double train_on_dataset(const std::vector<M*> & models, const ffm_dataset & dataset, uint dropout_prob_log) {
+ffm_double train_on_dataset(const std::vector<M*> & models, const ffm_dataset & dataset, uint dropout_prob_log, uint64_t seed) {
     float dropout_mult = (1 << dropout_prob_log) / ((1 << dropout_prob_log) - 1.0f);
 
     time_t start_time = time(nullptr);
@@ -139,78 +214,173 @@ ffm_double train_on_dataset(const std::vector<M*> & models, const ffm_dataset &
     std::cout << "  Training... ";
     std::cout.flush();
 
-    auto batches = generate_batches(dataset.index, true);
+    auto batches = generate_batches(dataset.index, true, seed);
+    auto reader = open_batch_reader(dataset, batches);
 
     ffm_double loss = 0.0;
     ffm_ulong cnt = 0;
 
-    // Iterate over batches, read each and then iterate over examples
-    #pragma omp parallel for schedule(dynamic, 1) reduction(+: loss) reduction(+: cnt)
-    for (ffm_ulong bi = 0; bi < batches.size(); ++ bi) {
-        auto batch_start_index = batches[bi].first;
-        auto batch_end_index = batches[bi].second;
+    // Take read batches from reader and iterate over examples
+    #pragma omp parallel reduction(+: loss) reduction(+: cnt)
+    {
+        uint64_t dropout_mask[dropout_mask_max_size];
+        ffm_batch batch;
+
+        // Examples of batched training with their own dropout masks
+        std::vector<uint64_t> batch_dropout_masks(batch_dense ? mini_batch_size * dropout_mask_max_size : 0);
+        ffm_batch_example batch_examples[mini_batch_size];
+        float batch_predictions[mini_batch_size];
 
-        auto batch_start_offset = dataset.index.offsets[batch_start_index];
-        auto batch_end_offset = dataset.index.offsets[batch_end_index];
+        while (reader->next(batch)) {
+            auto batch_start_index = batch.start;
+            auto batch_end_index = batch.end;
 
-        auto mini_batches = generate_mini_batches(batch_start_index, batch_end_index);
+            auto batch_start_offset = dataset.index.offsets[batch_start_index];
 
-        std::vector<ffm_feature> batch_features = ffm_read_batch(dataset.data_file_name, batch_start_offset, batch_end_offset);
-        ffm_feature * batch_features_data = batch_features.data();
+            auto mini_batches = generate_mini_batches(batch_start_index, batch_end_index);
 
-        uint64_t dropout_mask[dropout_mask_max_size];
+            // Random streams depend only on seed and batch position, not on thread which processes it
+            uint64_t batch_seed = mix_seed(seed, batch.index);
 
-        std::vector<float> ts(batch_end_index - batch_start_index);
-        std::vector<uint> tc(batch_end_index - batch_start_index);
+            xoshiro256x4 gen(mix_seed(batch_seed, 0));
+            xoshiro256 shuffle_gen(mix_seed(batch_seed, 1));
 
+            const ffm_feature * batch_features_data = batch.features;
 
-        for (uint mi = 0; mi < models.size(); ++ mi) {
-            std::shuffle(mini_batches.begin(), mini_batches.end(), rnd);
+            std::vector<float> ts(batch_end_index - batch_start_index);
+            std::vector<uint> tc(batch_end_index - batch_start_index);
+
+            for (uint mi = 0; mi < models.size(); ++ mi) {
+                std::shuffle(mini_batches.begin(), mini_batches.end(), shuffle_gen);
+
+                for (auto mb = mini_batches.begin(); mb != mini_batches.end(); ++ mb) {
+                    if (batch_dense) {
+                        uint n = mb->second - mb->first;
+
+                        for (uint k = 0; k < n; ++ k) {
+                            auto ei = mb->first + k;
+
+                            ffm_batch_example & ex = batch_examples[k];
+
+                            ex.start = batch_features_data + dataset.index.offsets[ei] - batch_start_offset;
+                            ex.end = batch_features_data + dataset.index.offsets[ei+1] - batch_start_offset;
+                            ex.norm = dataset.index.norms[ei];
+                            ex.dropout_mask = batch_dropout_masks.data() + k * dropout_mask_max_size;
 
-            for (auto mb = mini_batches.begin(); mb != mini_batches.end(); ++ mb) {
-                for (auto ei = mb->first; ei < mb->second; ++ ei) {
-                    ffm_float y = dataset.index.labels[ei];
-                    ffm_float norm = dataset.index.norms[ei];
+                            fill_mask_rand(ex.dropout_mask, (models[mi]->get_dropout_mask_size(ex.start, ex.end) + 63) / 64, dropout_prob_log, gen);
+                        }
 
-                    auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
-                    auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
+                        models[mi]->predict_batch(batch_examples, n, dropout_mult, batch_predictions);
 
-                    auto dropout_mask_size = models[mi]->get_dropout_mask_size(batch_features_data + start_offset, batch_features_data + end_offset);
+                        for (uint k = 0; k < n; ++ k) {
+                            auto ei = mb->first + k;
 
-                    fill_mask_rand(dropout_mask, (dropout_mask_size + 63) / 64, dropout_prob_log);
+                            ffm_float y = dataset.index.labels[ei];
+                            float t = batch_predictions[k];
+                            float expnyt = exp(-y*t);
 
-                    float t = models[mi]->predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, dropout_mask, dropout_mult);
-                    float expnyt = exp(-y*t);
+                            batch_examples[k].kappa = -y * expnyt / (1+expnyt);
 
-                    models[mi]->update(batch_features_data + start_offset, batch_features_data + end_offset, norm, -y * expnyt / (1+expnyt), dropout_mask, dropout_mult);
+                            uint i = ei - batch_start_index;
+                            ts[i] += t;
+                            tc[i] ++;
+                        }
 
-                    uint i = ei - batch_start_index;
-                    ts[i] += t;
-                    tc[i] ++;
+                        models[mi]->update_batch(batch_examples, n, dropout_mult);
+                    } else {
+                        for (auto ei = mb->first; ei < mb->second; ++ ei) {
+                            ffm_float y = dataset.index.labels[ei];
+                            ffm_float norm = dataset.index.norms[ei];
+
+                            auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
+                            auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
+
+                            auto dropout_mask_size = models[mi]->get_dropout_mask_size(batch_features_data + start_offset, batch_features_data + end_offset);
+
+                            fill_mask_rand(dropout_mask, (dropout_mask_size + 63) / 64, dropout_prob_log, gen);
+
+                            float t = models[mi]->predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, dropout_mask, dropout_mult);
+                            float expnyt = exp(-y*t);
+
+                            models[mi]->update(batch_features_data + start_offset, batch_features_data + end_offset, norm, -y * expnyt / (1+expnyt), dropout_mask, dropout_mult);
+
+                            uint i = ei - batch_start_index;
+                            ts[i] += t;
+                            tc[i] ++;
+                        }
+                    }
+
+                    models[mi]->merge_thread_updates();
                 }
             }
-        }
 
-        for (uint i = 0; i < batch_end_index - batch_start_index; ++ i)
-            loss += log(1+exp(-dataset.index.labels[i + batch_start_index]*ts[i]/tc[i]));
+            reader->release(batch);
+
+            for (uint i = 0; i < batch_end_index - batch_start_index; ++ i)
+                loss += log(1+exp(-dataset.index.labels[i + batch_start_index]*ts[i]/tc[i]));
 
-        cnt += batch_end_index - batch_start_index;
+            cnt += batch_end_index - batch_start_index;
+        }
+
+        for (uint mi = 0; mi < models.size(); ++ mi)
+            models[mi]->flush_thread_updates();
     }
 
-    std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt) << std::endl;
+    std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt);
+    std::cout << ", data wait = " << std::setprecision(2) << reader->wait_time() << " seconds" << std::endl;
 
     return loss;
 }
 
 
+// Logits of read batch examples by each model, example-major, predicted by runs of display groups if they share features
+template <typename M>
+void predict_batch_logits(const std::vector<M*> & models, const ffm_dataset & dataset, const ffm_batch & batch, uint64_t * dropout_mask, std::vector<float> & logits) {
+    auto batch_start_offset = dataset.index.offsets[batch.start];
+
+    ffm_batch_example examples[mini_batch_size];
+    float predictions[mini_batch_size];
+
+    logits.resize((batch.end - batch.start) * models.size());
+
+    for (auto gb = batch.start; gb < batch.end;) {
+        auto ge = share_group_features ? group_end(dataset.index, gb, batch.end) : gb + 1;
+        uint n = ge - gb;
+
+        for (uint k = 0; k < n; ++ k) {
+            auto ei = gb + k;
+
+            examples[k].start = batch.features + dataset.index.offsets[ei] - batch_start_offset;
+            examples[k].end = batch.features + dataset.index.offsets[ei+1] - batch_start_offset;
+            examples[k].norm = dataset.index.norms[ei];
+            examples[k].dropout_mask = dropout_mask;
+        }
+
+        for (uint mi = 0; mi < models.size(); ++ mi) {
+            if (share_group_features)
+                models[mi]->predict_group(examples, n, 1, predictions);
+            else
+                predictions[0] = models[mi]->predict(examples[0].start, examples[0].end, examples[0].norm, dropout_mask, 1);
+
+            for (uint k = 0; k < n; ++ k)
+                logits[(gb + k - batch.start) * models.size() + mi] = predictions[k];
+        }
+
+        gb = ge;
+    }
+}
+
+
+// Node models contain model copies for threads of each numa node, or single set shared by all threads
 template <typename M>
-ffm_double evaluate_on_dataset(const std::vector<M*> & models, const ffm_dataset & dataset) {
+ffm_eval_result evaluate_on_dataset(const std::vector<std::vector<M*>> & node_models, const ffm_dataset & dataset) {
     time_t start_time = time(nullptr);
 
     std::cout << "  Evaluating... ";
     std::cout.flush();
 
     auto batches = generate_batches(dataset.index, false);
+    auto reader = open_batch_reader(dataset, batches);
 
     uint64_t dropout_mask[dropout_mask_max_size];
     fill_mask_ones(dropout_mask, dropout_mask_max_size);
@@ -220,94 +390,162 @@ ffm_double evaluate_on_dataset(const std::vector<M*> & models, const ffm_dataset
 
     std::vector<ffm_float> predictions(dataset.index.size);
 
-    // Iterate over batches, read each and then iterate over examples
-    #pragma omp parallel for schedule(dynamic, 1) reduction(+: loss) reduction(+: cnt)
-    for (ffm_uint bi = 0; bi < batches.size(); ++ bi) {
-        auto batch_start_index = batches[bi].first;
-        auto batch_end_index = batches[bi].second;
+    // Take read batches from reader and iterate over examples
+    #pragma omp parallel reduction(+: loss) reduction(+: cnt)
+    {
+        const std::vector<M*> & models = node_models[numa_thread_node() % node_models.size()];
+        ffm_batch batch;
 
-        auto batch_start_offset = dataset.index.offsets[batch_start_index];
-        auto batch_end_offset = dataset.index.offsets[batch_end_index];
+        std::vector<float> batch_logits;
 
-        std::vector<ffm_feature> batch_features = ffm_read_batch(dataset.data_file_name, batch_start_offset, batch_end_offset);
-        ffm_feature * batch_features_data = batch_features.data();
+        while (reader->next(batch)) {
+            auto batch_start_index = batch.start;
+            auto batch_end_index = batch.end;
 
-        for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
-            ffm_float y = dataset.index.labels[ei];
-            ffm_float norm = dataset.index.norms[ei];
+            predict_batch_logits(models, dataset, batch, dropout_mask, batch_logits);
 
-            auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
-            auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
+            for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
+                ffm_float y = dataset.index.labels[ei];
 
-            float ts = 0.0;
-            uint tc = 0;
+                float ts = 0.0;
+                uint tc = 0;
 
-            for (uint mi = 0; mi < models.size(); ++ mi) {
-                ts += models[mi]->predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, dropout_mask, 1);
-                tc ++;
+                for (uint mi = 0; mi < models.size(); ++ mi) {
+                    ts += batch_logits[(ei - batch_start_index) * models.size() + mi];
+                    tc ++;
+                }
+
+                loss += log(1+exp(-y*ts/tc));
+                predictions[ei] = 1 / (1+exp(-ts/tc));
             }
 
-            loss += log(1+exp(-y*ts/tc));
-            predictions[ei] = 1 / (1+exp(-ts/tc));
-        }
+            reader->release(batch);
 
-        cnt += batch_end_index - batch_start_index;
+            cnt += batch_end_index - batch_start_index;
+        }
     }
 
     // Compute map metric
     ffm_double map = compute_map(dataset.index, predictions);
 
-    std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt) << ", map = " << map << std::endl;
+    std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, loss = " << std::fixed << std::setprecision(5) << (loss / cnt) << ", map = " << map;
+    std::cout << ", data wait = " << std::setprecision(2) << reader->wait_time() << " seconds" << std::endl;
 
-    return loss;
+    return ffm_eval_result { loss / cnt, map };
 }
 
 template <typename M>
-void predict_on_dataset(const std::vector<M*> & models, const ffm_dataset & dataset, std::ostream & out) {
+void predict_on_dataset(const std::vector<std::vector<M*>> & node_models, const ffm_dataset & dataset, std::vector<ffm_float> & predictions, std::vector<ffm_float> * logits) {
     time_t start_time = time(nullptr);
 
     std::cout << "  Predicting... ";
     std::cout.flush();
 
     auto batches = generate_batches(dataset.index, false);
+    auto reader = open_batch_reader(dataset, batches);
 
     uint64_t dropout_mask[dropout_mask_max_size];
     fill_mask_ones(dropout_mask, dropout_mask_max_size);
 
     ffm_ulong cnt = 0;
 
-    // Iterate over batches, read each and then iterate over examples
-    for (ffm_ulong bi = 0; bi < batches.size(); ++ bi) {
-        auto batch_start_index = batches[bi].first;
-        auto batch_end_index = batches[bi].second;
+    predictions.resize(dataset.index.size);
 
-        auto batch_start_offset = dataset.index.offsets[batch_start_index];
-        auto batch_end_offset = dataset.index.offsets[batch_end_index];
+    if (logits != nullptr)
+        logits->resize(dataset.index.size * node_models[0].size());
 
-        std::vector<ffm_feature> batch_features = ffm_read_batch(dataset.data_file_name, batch_start_offset, batch_end_offset);
-        ffm_feature * batch_features_data = batch_features.data();
+    // Take read batches from reader and iterate over examples
+    #pragma omp parallel reduction(+: cnt)
+    {
+        const std::vector<M*> & models = node_models[numa_thread_node() % node_models.size()];
+        ffm_batch batch;
 
-        for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
-            ffm_float norm = dataset.index.norms[ei];
+        std::vector<float> batch_logits;
 
-            auto start_offset = dataset.index.offsets[ei] - batch_start_offset;
-            auto end_offset = dataset.index.offsets[ei+1] - batch_start_offset;
+        while (reader->next(batch)) {
+            auto batch_start_index = batch.start;
+            auto batch_end_index = batch.end;
 
-            float ts = 0.0;
-            uint tc = 0;
+            predict_batch_logits(models, dataset, batch, dropout_mask, batch_logits);
 
-            for (uint mi = 0; mi < models.size(); ++ mi) {
-                ts += models[mi]->predict(batch_features_data + start_offset, batch_features_data + end_offset, norm, dropout_mask, 1);
-                tc ++;
+            for (auto ei = batch_start_index; ei < batch_end_index; ++ ei) {
+                float ts = 0.0;
+                uint tc = 0;
+
+                for (uint mi = 0; mi < models.size(); ++ mi) {
+                    float t = batch_logits[(ei - batch_start_index) * models.size() + mi];
+
+                    if (logits != nullptr)
+                        (*logits)[ei * models.size() + mi] = t;
+
+                    ts += t;
+                    tc ++;
+                }
+
+                predictions[ei] = 1/(1+exp(-ts/tc));
+            }
+
+            reader->release(batch);
+
+            cnt += batch_end_index - batch_start_index;
+        }
+    }
+
+    std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds, data wait = " << std::fixed << std::setprecision(2) << reader->wait_time() << " seconds" << std::endl;
+}
+
+
+// Write predictions vector (cols = 0) or row-major matrix in text, raw float32 or numpy format
+void write_predictions(const std::string & file_name, const std::string & format, const std::vector<ffm_float> & data, ffm_ulong cols) {
+    ffm_ulong rows = cols > 0 ? data.size() / cols : data.size();
+
+    std::vector<char> out_buffer(1 << 24);
+
+    std::ofstream out;
+    out.rdbuf()->pubsetbuf(out_buffer.data(), out_buffer.size());
+    out.open(file_name, std::ios::binary);
+
+    if (!out)
+        throw std::runtime_error(std::string("Can't open prediction file ") + file_name);
+
+    if (format == "text") {
+        ffm_ulong row_size = cols > 0 ? cols : 1;
+
+        for (ffm_ulong i = 0; i < rows; ++ i) {
+            for (ffm_ulong j = 0; j < row_size; ++ j) {
+                if (j > 0)
+                    out << ' ';
+
+                out << data[i * row_size + j];
             }
 
-            out << 1/(1+exp(-ts/tc)) << std::endl;
+            out << '\n';
         }
+    } else if (format == "f32" || format == "npy") {
+        if (format == "npy") {
+            std::string shape = cols > 0 ? std::to_string(rows) + ", " + std::to_string(cols) : std::to_string(rows) + ",";
+            std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': (" + shape + "), }";
+
+            // Magic (6) + version (2) + header length (2) + header, padded with spaces to 64 bytes and terminated by newline
+            header.append(63 - (10 + header.size()) % 64, ' ');
+            header.push_back('\n');
 
-        cnt += batch_end_index - batch_start_index;
+            uint16_t header_len = header.size();
+
+            out.write("\x93NUMPY\x01\x00", 8);
+            out.write((const char *) &header_len, sizeof(header_len));
+            out.write(header.data(), header.size());
+        }
+
+        out.write((const char *) data.data(), data.size() * sizeof(ffm_float));
+    } else {
+        throw std::runtime_error(std::string("Unknown prediction format ") + format);
     }
 
-    std::cout << cnt << " examples processed in " << (time(nullptr) - start_time) << " seconds" << std::endl;
+    out.flush();
+
+    if (!out)
+        throw std::runtime_error(std::string("Error writing predictions to ") + file_name);
 }
 
 
@@ -321,11 +559,81 @@ ffm_dataset open_dataset(const std::string & file_name) {
     res.index = ffm_read_index(file_name + ".index");
     res.data_file_name = file_name + ".data";
 
+    if (map_data) {
+        res.data_map = std::make_shared<ffm_data_map>(res.data_file_name);
+        res.features = res.data_map->data();
+    }
+
     std::cout << res.index.size << " examples" << std::endl;
 
     return res;
 }
 
+// Number of fields present in data file, scanned through memory mapping
+ffm_uint count_data_fields(const std::string & file_name) {
+    ffm_data_map data_map(file_name + ".data");
+    data_map.advise_sequential(true);
+
+    const ffm_feature * features = data_map.data();
+    ffm_ulong size = data_map.size();
+    ffm_uint max_field = 0;
+
+    #pragma omp parallel for schedule(static) reduction(max: max_field)
+    for (ffm_ulong i = 0; i < size; ++ i)
+        max_field = std::max(max_field, features[i].index >> ffm_hash_bits);
+
+    return size > 0 ? max_field + 1 : 0;
+}
+
+
+// Available memory in bytes, including reclaimable page cache
+ffm_ulong available_memory() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    ffm_ulong value;
+
+    while (meminfo >> key >> value) {
+        if (key == "MemAvailable:")
+            return value * 1024;
+
+        meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+
+    return sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+}
+
+
+// Load data of all given datasets into single in-memory cache
+std::unique_ptr<ffm_data_cache> cache_datasets(const std::vector<ffm_dataset *> & datasets, float limit_gb, bool huge_pages) {
+    std::vector<ffm_ulong> sizes;
+
+    for (auto ds = datasets.begin(); ds != datasets.end(); ++ ds)
+        sizes.push_back((*ds)->index.offsets[(*ds)->index.size]);
+
+    ffm_ulong required_bytes = ffm_data_cache::required_capacity(sizes) * sizeof(ffm_feature);
+    ffm_ulong limit_bytes = limit_gb > 0 ? ffm_ulong(limit_gb * (1ul << 30)) : available_memory();
+
+    if (required_bytes > limit_bytes)
+        throw std::runtime_error(std::string("Data cache requires ") + std::to_string(required_bytes >> 20) + " MB, but limit is " + std::to_string(limit_bytes >> 20) + " MB");
+
+    time_t start_time = time(nullptr);
+
+    std::cout << "Caching data... ";
+    std::cout.flush();
+
+    std::unique_ptr<ffm_data_cache> cache(new ffm_data_cache(ffm_data_cache::required_capacity(sizes), huge_pages));
+
+    for (uint i = 0; i < datasets.size(); ++ i) {
+        datasets[i]->features = cache->load(datasets[i]->data_file_name, sizes[i]);
+        datasets[i]->data_map.reset(); // Mapping is not needed anymore
+    }
+
+    std::cout << (required_bytes >> 20) << " MB loaded in " << (time(nullptr) - start_time) << " seconds" << std::endl;
+
+    return cache;
+}
+
+
 class program_options {
     boost::program_options::options_description desc;
 public:
@@ -333,41 +641,106 @@ public:
     std::string val_file_name;
     std::string test_file_name;
     std::string pred_file_name;
+    std::string pred_format;
+    std::string logits_file_name;
+
+    std::string save_model_file_name;
+    std::string load_model_file_name;
+    std::string export_model_file_name;
+    std::string snapshot_file_name;
+
+    std::string early_stopping_metric;
+
+    std::string numa_policy;
+    std::string huge_pages;
+    std::string weight_format;
+    std::string export_weight_format;
+    std::string optimizer;
+    std::string simd;
 
     std::string model_name;
 
     uint n_epochs;
     uint n_threads;
+    uint n_io_threads;
+    uint n_prefetch;
     uint n_models;
     uint seed;
 
+    uint n_dim;
+    uint n_fields;
+    uint hash_bits;
+
+    uint early_stopping;
+
     bool restricted;
+    bool temporary_snapshot;
+    bool inference;
+    bool map_data;
+    bool cache_data;
+    bool cache_huge_pages;
+    bool dense_replicas;
+    bool batch_dense;
+    bool aggregate_updates;
+    bool shard_updates;
+    bool share_group_features;
+
+    float cache_limit;
 
     uint dropout_prob_log;
 
     float eta, lambda;
 public:
     program_options(int ac, char* av[]):
-        desc("Allowed options"), model_name("ffm"), n_epochs(10), n_threads(4), n_models(1), seed(2017),
-        dropout_prob_log(1), eta(0), lambda(0)
+        desc("Allowed options"), pred_format("text"), early_stopping_metric("map"), numa_policy("none"), huge_pages("none"), weight_format("fp32"), optimizer("adagrad"), simd("auto"), model_name("ffm"), n_epochs(10), n_threads(4), n_io_threads(1), n_prefetch(4), n_models(1), seed(2017), n_dim(0), n_fields(0), hash_bits(ffm_hash_bits), early_stopping(0),
+        cache_limit(0), dropout_prob_log(1), eta(0), lambda(0)
     {
         using namespace boost::program_options;
 
         desc.add_options()
             ("help", "train dataset file")
             ("model", value<std::string>(&model_name), "model name")
-            ("train", value<std::string>(&train_file_name)->required(), "train dataset file")
+            ("train", value<std::string>(&train_file_name), "train dataset file")
             ("val", value<std::string>(&val_file_name), "validation dataset file")
             ("test", value<std::string>(&test_file_name), "test dataset file")
             ("pred", value<std::string>(&pred_file_name), "file to save predictions")
+            ("pred-format", value<std::string>(&pred_format), "predictions file format: text, f32 or npy (default text)")
+            ("pred-logits", value<std::string>(&logits_file_name), "file to save raw logits of each averaged model, in prediction format")
+            ("save-model", value<std::string>(&save_model_file_name), "file to save trained model checkpoint")
+            ("load-model", value<std::string>(&load_model_file_name), "file to load model checkpoint from before training")
+            ("export-model", value<std::string>(&export_model_file_name), "file to save inference-only ffm model, without optimizer state")
+            ("export-weight-format", value<std::string>(&export_weight_format), "weight format of exported model: fp32, fp16, bf16 or int8 with per-row scale (default is model weight format)")
+            ("inference", "loaded model is inference-only one, saved with --export-model")
             ("epochs", value<uint>(&n_epochs), "number of epochs (default 10)")
+            ("early-stopping", value<uint>(&early_stopping), "stop after given number of epochs without validation improvement and use best epoch model (default 0, disabled)")
+            ("early-stopping-metric", value<std::string>(&early_stopping_metric), "validation metric for early stopping: map or loss (default map)")
+            ("snapshot", value<std::string>(&snapshot_file_name), "file to keep best epoch model in for early stopping (default is temporary file)")
             ("threads", value<uint>(&n_threads), "number of threads (default 4)")
+            ("huge-pages", value<std::string>(&huge_pages), "huge pages for model weights: none, thp, 2m or 1g, falling back to smaller ones if not available (default none)")
+            ("numa", value<std::string>(&numa_policy), "model placement on numa nodes: none, interleave or replicate (prediction only), threads are pinned unless none (default none)")
+            ("simd", value<std::string>(&simd), "instruction set of model kernels: auto, avx512, avx2 or scalar, auto is best one supported by cpu (default auto)")
+            ("io-threads", value<uint>(&n_io_threads), "number of data reading threads (default 1)")
+            ("prefetch", value<uint>(&n_prefetch), "number of batches to read ahead (default 4)")
             ("average", value<uint>(&n_models), "number of models to average (default 1)")
+            ("weight-format", value<std::string>(&weight_format), "storage of ffm model interaction weights: fp32, fp16, bf16 or int8 (inference only) (default fp32)")
+            ("optimizer", value<std::string>(&optimizer), "optimizer of ffm and ffm-nn interaction weights: adagrad or row-adagrad with single accumulator per row, which halves interaction weights memory at cost of shared step size in row (default adagrad)")
             ("seed", value<uint>(&seed), "random seed")
+            ("dim", value<uint>(&n_dim), "size of ffm and ffm-nn latent vectors: 4, 8, 14, 16 or 32 for ffm, 16 for ffm-nn (default 14 for ffm, 16 for ffm-nn)")
+            ("fields", value<uint>(&n_fields), "number of fields of ffm and ffm-nn models (default is number of fields present in datasets)")
+            ("hash-bits", value<uint>(&hash_bits), "feature hash bits used by ffm and ffm-nn models, at most ones of data (default 20)")
+            ("dense-replicas", "keep per-thread copies of dense layers of nn and ffm-nn models in training, merged into shared ones after each mini-batch")
+            ("aggregate-updates", "accumulate gradients of ffm and ftrl weight rows over each mini-batch and update every touched row once")
+            ("shard-updates", "partition ffm interaction rows between training threads by hash, and send aggregated updates of other threads rows to their owners by lock-free queues, single model only")
+            ("share-group-features", "in evaluation and prediction of ffm model, compute interactions of leading features shared by all examples of display group, like event ones, once per group; training is not affected, as sharing would tie dropout masks and updates of group examples")
+            ("batch-dense", "train nn and ffm-nn models on whole mini-batches, with dense layers as matrix products and single update of their weights per mini-batch")
             ("dropout-log", value<uint>(&dropout_prob_log), "binary log of dropout probability (default 1)")
             ("eta", value<float>(&eta), "learning rate")
             ("lambda", value<float>(&lambda), "l2 regularization coeff")
             ("restricted", "restrict feature interactions to (E+C) * (C+A)")
+            ("mmap", "use memory-mapped data files instead of reading batches")
+            ("cache-data", "load train and validation data in memory once for all epochs")
+            ("cache-huge-pages", "use transparent huge pages for data cache")
+            ("cache-limit", value<float>(&cache_limit), "data cache memory limit in GB (default is available memory)")
         ;
 
         variables_map vm;
@@ -379,41 +752,330 @@ public:
         }
 
         restricted = vm.count("restricted") > 0;
+        inference = vm.count("inference") > 0;
+        map_data = vm.count("mmap") > 0;
+        cache_data = vm.count("cache-data") > 0;
+        cache_huge_pages = vm.count("cache-huge-pages") > 0;
+        dense_replicas = vm.count("dense-replicas") > 0;
+        batch_dense = vm.count("batch-dense") > 0;
+        aggregate_updates = vm.count("aggregate-updates") > 0;
+        shard_updates = vm.count("shard-updates") > 0;
+        share_group_features = vm.count("share-group-features") > 0;
 
         notify(vm);
+
+        if (train_file_name.empty() && load_model_file_name.empty())
+            throw std::runtime_error("Either train dataset or model checkpoint should be given");
+
+        if (huge_pages != "none" && huge_pages != "thp" && huge_pages != "2m" && huge_pages != "1g")
+            throw std::runtime_error(std::string("Unknown huge pages mode ") + huge_pages);
+
+        if (numa_policy != "none" && numa_policy != "interleave" && numa_policy != "replicate")
+            throw std::runtime_error(std::string("Unknown numa policy ") + numa_policy);
+
+        if (numa_policy == "replicate" && !train_file_name.empty())
+            throw std::runtime_error("Replicated models can be used only for prediction");
+
+        if (simd != "auto" && simd != "avx512" && simd != "avx2" && simd != "scalar")
+            throw std::runtime_error(std::string("Unknown instruction set ") + simd);
+
+        if (weight_format != "fp32" && weight_format != "fp16" && weight_format != "bf16" && weight_format != "int8")
+            throw std::runtime_error(std::string("Unknown weight format ") + weight_format);
+
+        if (weight_format == "int8" && !inference)
+            throw std::runtime_error("Int8 weights are supported only by inference-only models");
+
+        if (weight_format != "fp32" && model_name != "ffm")
+            throw std::runtime_error("Half precision weights are supported only by ffm model");
+
+        if (export_weight_format.empty())
+            export_weight_format = weight_format;
+
+        if (export_weight_format != "fp32" && export_weight_format != "fp16" && export_weight_format != "bf16" && export_weight_format != "int8")
+            throw std::runtime_error(std::string("Unknown weight format ") + export_weight_format);
+
+        if ((inference || !export_model_file_name.empty()) && model_name != "ffm")
+            throw std::runtime_error("Inference-only models are supported only by ffm model");
+
+        if (inference && (load_model_file_name.empty() || !train_file_name.empty()))
+            throw std::runtime_error("Inference-only model should be loaded and can't be trained");
+
+        if (optimizer != "adagrad" && optimizer != "row-adagrad")
+            throw std::runtime_error(std::string("Unknown optimizer ") + optimizer);
+
+        if (optimizer != "adagrad" && model_name != "ffm" && model_name != "ffm-nn")
+            throw std::runtime_error("Row-wise AdaGrad is supported only by ffm and ffm-nn models");
+
+        if (dense_replicas && model_name != "nn" && model_name != "ffm-nn")
+            throw std::runtime_error("Dense layer replicas are supported only by nn and ffm-nn models");
+
+        if (batch_dense && model_name != "nn" && model_name != "ffm-nn")
+            throw std::runtime_error("Batched dense layers are supported only by nn and ffm-nn models");
+
+        if (aggregate_updates && model_name != "ffm" && model_name != "ftrl")
+            throw std::runtime_error("Aggregated updates are supported only by ffm and ftrl models");
+
+        if (shard_updates && model_name != "ffm")
+            throw std::runtime_error("Sharded updates are supported only by ffm model");
+
+        // Thread waiting for queues of one model doesn't drain queues of others, so threads sending rows of different
+        // models to each other would wait forever
+        if (shard_updates && n_models > 1)
+            throw std::runtime_error("Sharded updates are supported only with single model");
+
+        if (share_group_features && model_name != "ffm")
+            throw std::runtime_error("Group-shared prediction is supported only by ffm model");
+
+        if (early_stopping_metric != "map" && early_stopping_metric != "loss")
+            throw std::runtime_error(std::string("Unknown early stopping metric ") + early_stopping_metric);
+
+        if (early_stopping > 0 && (train_file_name.empty() || val_file_name.empty()))
+            throw std::runtime_error("Early stopping requires training and validation datasets");
+
+        temporary_snapshot = early_stopping > 0 && snapshot_file_name.empty();
+
+        if (temporary_snapshot)
+            snapshot_file_name = std::string("/tmp/ffm-") + std::to_string(getpid()) + ".snapshot";
     }
 };
 
 
 template <typename M>
-void apply(const std::vector<M*> & models, program_options & opts) {
+void save_models(const std::vector<M*> & models, const std::string & model_name, const std::string & file_name) {
+    time_t start_time = time(nullptr);
+
+    std::cout << "Saving model to " << file_name << "... ";
+    std::cout.flush();
+
+    ffm_checkpoint_writer out(file_name, model_name, models.size());
+
+    for (uint mi = 0; mi < models.size(); ++ mi)
+        models[mi]->save(out);
+
+    out.close();
+
+    std::cout << "done in " << (time(nullptr) - start_time) << " seconds" << std::endl;
+}
+
+
+template <typename M>
+void load_models(const std::vector<M*> & models, const std::string & model_name, const std::string & file_name) {
+    time_t start_time = time(nullptr);
+
+    std::cout << "Loading model from " << file_name << "... ";
+    std::cout.flush();
+
+    ffm_checkpoint_reader in(file_name);
+
+    if (in.model_name != model_name)
+        throw std::runtime_error(std::string("Checkpoint contains model ") + in.model_name + ", not " + model_name);
+
+    if (in.n_models != models.size())
+        throw std::runtime_error(std::string("Checkpoint contains ") + std::to_string(in.n_models) + " models, but " + std::to_string(models.size()) + " requested");
+
+    for (uint mi = 0; mi < models.size(); ++ mi)
+        models[mi]->load(in);
+
+    std::cout << "done in " << (time(nullptr) - start_time) << " seconds" << std::endl;
+}
+
+
+// Dimensions of ffm and ffm-nn models, loaded model defines them itself. Fields of every dataset should fit
+// into model, as kernels index weights by field without checking it
+ffm_model_dims model_dims(const program_options & opts, uint default_dim) {
+    ffm_model_dims dims;
+    ffm_uint data_fields = 0;
+
+    for (auto fn : { opts.train_file_name, opts.val_file_name, opts.test_file_name })
+        if (!fn.empty())
+            data_fields = std::max(data_fields, count_data_fields(fn));
+
+    if (!opts.load_model_file_name.empty()) {
+        ffm_checkpoint_reader in(opts.load_model_file_name);
+
+        // Checkpoints of both models start with the same dimensions
+        dims.n_fields = in.read<ffm_ulong>();
+        dims.hash_bits = __builtin_ctzll(in.read<ffm_ulong>());
+        dims.n_dim = in.read<ffm_ulong>();
+
+        if (data_fields > dims.n_fields)
+            throw std::runtime_error(std::string("Data has ") + std::to_string(data_fields) + " fields, but loaded model only " + std::to_string(dims.n_fields));
+
+        return dims;
+    }
+
+    dims.n_dim = opts.n_dim > 0 ? opts.n_dim : default_dim;
+    dims.hash_bits = opts.hash_bits;
+    dims.n_fields = opts.n_fields;
+
+    if (dims.n_fields == 0) {
+        dims.n_fields = data_fields;
+
+        std::cout << "Found " << dims.n_fields << " fields in data" << std::endl;
+    } else if (data_fields > dims.n_fields) {
+        throw std::runtime_error(std::string("Data has ") + std::to_string(data_fields) + " fields, but only " + std::to_string(dims.n_fields) + " requested");
+    }
+
+    return dims;
+}
+
+
+// Export inference-only models, supported only by ffm model
+template <typename M>
+void export_models(const std::vector<M*> &, const program_options &) {
+    throw std::runtime_error("Model can't be exported");
+}
+
+
+ffm_weight_format parse_weight_format(const std::string & format) {
+    if (format == "fp16")
+        return ffm_weight_format::fp16;
+    else if (format == "bf16")
+        return ffm_weight_format::bf16;
+    else if (format == "int8")
+        return ffm_weight_format::int8;
+    else
+        return ffm_weight_format::fp32;
+}
+
+
+void export_models(const std::vector<ffm_model*> & models, const program_options & opts) {
+    time_t start_time = time(nullptr);
+
+    std::cout << "Exporting inference model to " << opts.export_model_file_name << "... ";
+    std::cout.flush();
+
+    ffm_checkpoint_writer out(opts.export_model_file_name, opts.model_name, models.size());
+
+    for (uint mi = 0; mi < models.size(); ++ mi)
+        models[mi]->save_inference(out, parse_weight_format(opts.export_weight_format));
+
+    out.close();
+
+    std::cout << "done in " << (time(nullptr) - start_time) << " seconds" << std::endl;
+}
+
+
+// Create models placed in memory according to numa policy, returns model set per node if models are replicated
+template <typename M, typename F>
+std::vector<std::vector<M*>> create_models(F create_model, const program_options & opts) {
+    std::vector<std::vector<M*>> node_models;
+
+    if (opts.numa_policy == "replicate") {
+        auto nodes = numa_nodes();
+
+        for (auto n = nodes.begin(); n != nodes.end(); ++ n) {
+            numa_set_bind(*n);
+
+            node_models.push_back(std::vector<M*>());
+
+            for (uint i = 0; i < opts.n_models; ++ i)
+                node_models.back().push_back(create_model(i));
+        }
+
+        numa_set_default();
+    } else {
+        if (opts.numa_policy == "interleave")
+            numa_set_interleave();
+
+        node_models.push_back(std::vector<M*>());
+
+        for (uint i = 0; i < opts.n_models; ++ i)
+            node_models.back().push_back(create_model(i));
+
+        if (opts.numa_policy == "interleave")
+            numa_set_default();
+    }
+
+    if (huge_pages() != huge_pages_mode::none)
+        std::cout << "Model memory: " << describe_huge_page_allocations() << std::endl;
+
+    return node_models;
+}
+
+
+template <typename M, typename F>
+void apply(F create_model, program_options & opts) {
     using namespace std;
 
-    if (opts.val_file_name.empty()) { // No validation set given, just train
+    auto node_models = create_models<M>(create_model, opts);
+    auto & models = node_models[0]; // Models used for training
+
+    if (!opts.load_model_file_name.empty())
+        for (auto nm = node_models.begin(); nm != node_models.end(); ++ nm)
+            load_models(*nm, opts.model_name, opts.load_model_file_name);
+
+    if (opts.train_file_name.empty()) { // No train set given, use loaded model as is
+        if (!opts.val_file_name.empty())
+            evaluate_on_dataset(node_models, open_dataset(opts.val_file_name));
+    } else if (opts.val_file_name.empty()) { // No validation set given, just train
         auto ds_train = open_dataset(opts.train_file_name);
+        auto cache = opts.cache_data ? cache_datasets({ &ds_train }, opts.cache_limit, opts.cache_huge_pages) : nullptr;
 
         for (ffm_uint epoch = 0; epoch < opts.n_epochs; ++ epoch) {
             cout << "Epoch " << epoch << "..." << endl;
 
-            train_on_dataset(models, ds_train, opts.dropout_prob_log);
+            train_on_dataset(models, ds_train, opts.dropout_prob_log, mix_seed(opts.seed, epoch));
         }
     } else { // Train with validation each epoch
         auto ds_train = open_dataset(opts.train_file_name);
         auto ds_val = open_dataset(opts.val_file_name);
+        auto cache = opts.cache_data ? cache_datasets({ &ds_train, &ds_val }, opts.cache_limit, opts.cache_huge_pages) : nullptr;
+
+        ffm_double best_score = 0;
+        ffm_uint best_epoch = 0, last_epoch = 0;
 
         for (ffm_uint epoch = 0; epoch < opts.n_epochs; ++ epoch) {
             cout << "Epoch " << epoch << "..." << endl;
 
-            train_on_dataset(models, ds_train, opts.dropout_prob_log);
-            evaluate_on_dataset(models, ds_val);
+            train_on_dataset(models, ds_train, opts.dropout_prob_log, mix_seed(opts.seed, epoch));
+            auto res = evaluate_on_dataset(node_models, ds_val);
+
+            last_epoch = epoch;
+
+            if (opts.early_stopping == 0)
+                continue;
+
+            ffm_double score = opts.early_stopping_metric == "loss" ? -res.loss : res.map;
+
+            if (epoch == 0 || score > best_score) {
+                best_score = score;
+                best_epoch = epoch;
+
+                // Snapshot is not needed if there are no more epochs to overwrite current weights
+                if (epoch + 1 < opts.n_epochs)
+                    save_models(models, opts.model_name, opts.snapshot_file_name);
+            } else if (epoch - best_epoch >= opts.early_stopping) {
+                cout << "No improvement in " << opts.early_stopping_metric << " since epoch " << best_epoch << ", stopping" << endl;
+                break;
+            }
         }
+
+        if (opts.early_stopping > 0 && best_epoch != last_epoch) {
+            cout << "Using model from epoch " << best_epoch << endl;
+            load_models(models, opts.model_name, opts.snapshot_file_name);
+        }
+
+        if (opts.temporary_snapshot)
+            remove(opts.snapshot_file_name.c_str());
     }
 
+    if (!opts.save_model_file_name.empty())
+        save_models(models, opts.model_name, opts.save_model_file_name);
+
+    if (!opts.export_model_file_name.empty())
+        export_models(models, opts);
+
     if (!opts.test_file_name.empty() && !opts.pred_file_name.empty()) {
         auto ds_test = open_dataset(opts.test_file_name);
 
-        ofstream out(opts.pred_file_name);
-        predict_on_dataset(models, ds_test, out);
+        vector<ffm_float> predictions, logits;
+        predict_on_dataset(node_models, ds_test, predictions, opts.logits_file_name.empty() ? nullptr : &logits);
+
+        write_predictions(opts.pred_file_name, opts.pred_format, predictions, 0);
+
+        if (!opts.logits_file_name.empty())
+            write_predictions(opts.logits_file_name, opts.pred_format, logits, models.size());
     }
 }
 
@@ -423,46 +1085,58 @@ int main(int ac, char* av[]) {
 
     // Init global state
     omp_set_num_threads(opts.n_threads);
-    rnd.seed(opts.seed);
+    io_threads = opts.n_io_threads;
+    prefetch_batches = opts.n_prefetch;
+    map_data = opts.map_data;
+    batch_dense = opts.batch_dense;
+    share_group_features = opts.share_group_features;
+
+    if (opts.huge_pages == "thp")
+        huge_pages() = huge_pages_mode::thp;
+    else if (opts.huge_pages == "2m")
+        huge_pages() = huge_pages_mode::huge_2m;
+    else if (opts.huge_pages == "1g")
+        huge_pages() = huge_pages_mode::huge_1g;
+
+    if (opts.numa_policy != "none")
+        numa_pin_threads();
+
+    if (opts.simd != "auto") {
+        simd_isa isa = opts.simd == "avx512" ? simd_isa::avx512 : opts.simd == "avx2" ? simd_isa::avx2 : simd_isa::scalar;
+
+        if (isa > detect_simd_isa())
+            throw std::runtime_error(std::string("Instruction set ") + opts.simd + " is not supported by cpu");
+
+        simd_kernels() = isa;
+    }
+
+    std::cout << "Using " << simd_isa_name(simd_kernels()) << " kernels" << std::endl;
+
+    ffm_optimizer optimizer = opts.optimizer == "row-adagrad" ? ffm_optimizer::row_adagrad : ffm_optimizer::adagrad;
 
     // Run model
     if (opts.model_name == "ffm") {
         float eta = opts.eta > 0 ? opts.eta : 0.2;
         float lambda = opts.lambda > 0 ? opts.lambda : 0.00002;
 
-        std::vector<ffm_model*> models;
-
-        for (uint i = 0; i < opts.n_models; ++ i)
-            models.push_back(new ffm_model(opts.seed + 100 + i * 17, opts.restricted, eta, lambda));
+        ffm_weight_format weight_format = parse_weight_format(opts.weight_format);
+        ffm_model_dims dims = model_dims(opts, 14);
 
-        apply(models, opts);
+        apply<ffm_model>([&](uint i) { return new ffm_model(dims, opts.seed + 100 + i * 17, opts.restricted, eta, lambda, weight_format, opts.inference ? ffm_optimizer::none : optimizer, opts.aggregate_updates, opts.shard_updates); }, opts);
     } else if (opts.model_name == "ffm-nn") {
         float eta = opts.eta > 0 ? opts.eta : 0.05;
         float lambda = opts.lambda > 0 ? opts.lambda : 0.00002;
 
-        std::vector<ffm_nn_model*> models;
+        ffm_model_dims dims = model_dims(opts, 16);
 
-        for (uint i = 0; i < opts.n_models; ++ i)
-            models.push_back(new ffm_nn_model(opts.seed + 100 + i * 17, opts.restricted, eta, lambda, 0.0001));
-
-        apply(models, opts);
+        apply<ffm_nn_model>([&](uint i) { return new ffm_nn_model(dims, opts.seed + 100 + i * 17, opts.restricted, eta, lambda, 0.0001, optimizer, opts.dense_replicas); }, opts);
     } else if (opts.model_name == "ftrl") {
-        std::vector<ftrl_model*> models;
-
-        for (uint i = 0; i < opts.n_models; ++ i)
-            models.push_back(new ftrl_model(24, 1.0, 2.0, 2e-4, 5e-4));
-
-        apply(models, opts);
+        apply<ftrl_model>([&](uint i) { return new ftrl_model(24, 1.0, 2.0, 2e-4, 5e-4, opts.aggregate_updates); }, opts);
     } else if (opts.model_name == "nn") {
         float eta = opts.eta > 0 ? opts.eta : 0.02;
         float lambda = opts.lambda > 0 ? opts.lambda : 0.00002;
 
-        std::vector<nn_model*> models;
-
-        for (uint i = 0; i < opts.n_models; ++ i)
-            models.push_back(new nn_model(opts.seed + 100 + i * 17, eta, lambda));
-
-        apply(models, opts);
+        apply<nn_model>([&](uint i) { return new nn_model(opts.seed + 100 + i * 17, eta, lambda, opts.dense_replicas); }, opts);
     } else {
         throw std::runtime_error(std::string("Unknown model ") + opts.model_name);
     }
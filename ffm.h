@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <functional>
+#include <stdexcept>
 
 typedef void * ffm_file;
 
@@ -21,6 +22,18 @@ struct ffm_feature {
     ffm_float value;
 };
 
+// Number of examples in training mini-batch
+const ffm_uint mini_batch_size = 24;
+
+// Mini-batch example of batched training, kappa is gradient of loss by prediction, set between predict and update
+struct ffm_batch_example {
+    const ffm_feature * start;
+    const ffm_feature * end;
+    ffm_float norm;
+    ffm_float kappa;
+    uint64_t * dropout_mask;
+};
+
 // Structure for fast access to data
 struct ffm_index {
     ffm_ulong size; // Number of examples;
@@ -41,6 +54,41 @@ std::vector<ffm_feature> ffm_read_batch(const std::string & file_name, ffm_ulong
 void ffm_read_batch(const std::string & file_name, ffm_ulong from, ffm_ulong to, std::vector<ffm_feature> & features);
 
 
+// Read-only memory mapping of data file, shares page cache between processes
+class ffm_data_map {
+    void * addr;
+    ffm_ulong length; // In bytes
+public:
+    ffm_data_map(const std::string & file_name);
+    ~ffm_data_map();
+
+    const ffm_feature * data() const { return (const ffm_feature *) addr; }
+    ffm_ulong size() const { return length / sizeof(ffm_feature); }
+
+    // Hint kernel about access pattern of the whole file
+    void advise_sequential(bool sequential) const;
+
+    // Hint kernel to start reading given range of features
+    void advise_willneed(ffm_ulong from, ffm_ulong to) const;
+};
+
+
+// Single aligned memory buffer holding data of several files
+class ffm_data_cache {
+    ffm_feature * buffer;
+    ffm_ulong capacity, used; // In features
+public:
+    ffm_data_cache(ffm_ulong capacity, bool huge_pages);
+    ~ffm_data_cache();
+
+    // Read first size features of data file into cache and return pointer to them
+    const ffm_feature * load(const std::string & file_name, ffm_ulong size);
+
+    // Size of cache buffer needed for given file sizes (in features)
+    static ffm_ulong required_capacity(const std::vector<ffm_ulong> & sizes);
+};
+
+
 // Writes data files in sequential order
 class ffm_stream_data_writer {
     ffm_file file;
@@ -52,6 +100,89 @@ public:
     ffm_ulong write(const std::vector<ffm_feature> & features);
 };
 
+// Dimensions of field-aware models, chosen at runtime
+struct ffm_model_dims {
+    ffm_uint n_fields; // Number of fields, data shouldn't have larger ones
+    ffm_uint hash_bits; // Hash bits of feature index used by model, at most ffm_hash_bits of data
+    ffm_uint n_dim; // Size of latent vectors
+};
+
+
+// Optimizer of interaction weights: AdaGrad with accumulator per coordinate, or one per (index, field) row,
+// none for inference-only models which keep weights alone
+enum class ffm_optimizer { adagrad, row_adagrad, none };
+
+
+// Model checkpoints
+
+const ffm_uint ffm_checkpoint_version = 3;
+
+// Writes model state as a sequence of scalars and aligned arrays
+class ffm_checkpoint_writer {
+    ffm_file file;
+    ffm_ulong offset;
+public:
+    ffm_checkpoint_writer(const std::string & file_name, const std::string & model_name, ffm_uint n_models);
+    ~ffm_checkpoint_writer(); // Closes file without checks if close() wasn't called, as after write error
+
+    // Flush and close file, throws if any of buffered data can't be written
+    void close();
+
+    template <typename T>
+    void write(const T & value) {
+        write_raw(&value, sizeof(T));
+    }
+
+    template <typename T>
+    void write_array(const T * data, ffm_ulong size) {
+        write(size);
+        align();
+        write_raw(data, size * sizeof(T));
+    }
+private:
+    void write_raw(const void * data, ffm_ulong size);
+    void align();
+};
+
+// Reads model state from memory-mapped checkpoint file
+class ffm_checkpoint_reader {
+    const char * data;
+    ffm_ulong size;
+    ffm_ulong offset;
+public:
+    std::string model_name;
+    ffm_uint n_models;
+public:
+    ffm_checkpoint_reader(const std::string & file_name);
+    ~ffm_checkpoint_reader();
+
+    template <typename T>
+    T read() {
+        T value;
+        read_raw(&value, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void read_array(T * data, ffm_ulong size) {
+        if (read<ffm_ulong>() != size)
+            throw std::runtime_error("Checkpoint array size mismatch");
+
+        align();
+        read_raw(data, size * sizeof(T));
+    }
+
+    // Read value and check that it's equal to expected one, used for model constants
+    template <typename T>
+    void expect(const T & value, const char * name) {
+        if (read<T>() != value)
+            throw std::runtime_error(std::string("Checkpoint ") + name + " mismatch");
+    }
+private:
+    void read_raw(void * data, ffm_ulong size);
+    void align();
+};
+
 // Feature builder helper
 
 
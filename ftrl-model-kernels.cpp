@@ -0,0 +1,41 @@
+#include "ftrl-model.h"
+#include "util/model-helpers.h"
+#include "util/simd.h"
+
+// Update kernel of ftrl model, compiled once per instruction set SIMD_ISA
+
+
+template <typename V>
+void ftrl_model::update_simd(const uint * fi, const float * fv, const float * fw, uint feature_count, float grad) {
+    typedef typename V::vec vec;
+
+    float * n = weights_n;
+
+    vec v_alpha = V::set1(alpha);
+    vec v_grad = V::set1(grad);
+
+    alignas(64) float za[V::width];
+    alignas(64) float gs[V::width];
+
+    for (uint i = 0; i < feature_count; i += V::width) {
+        uint fl = simd_lanes<V>(i, feature_count);
+
+        vec v_n = V::gather(n, fi + i, fl);
+
+        vec v_fg = V::load(fv + i, fl) * v_grad;
+        vec v_fg_sqr = v_fg * v_fg;
+
+        vec v_sigma = (V::sqrt(v_n + v_fg_sqr) - V::sqrt(v_n)) / v_alpha;
+
+        V::store(za, V::fnmadd(v_sigma, V::load(fw + i, fl), v_fg), fl);
+        V::store(gs, v_fg_sqr, fl);
+
+        for (uint j = 0; j < fl; ++ j) {
+            weights_z[fi[i + j]] += za[j];
+            weights_n[fi[i + j]] += gs[j];
+        }
+    }
+}
+
+
+template void ftrl_model::update_simd<SIMD_ISA>(const uint * fi, const float * fv, const float * fw, uint feature_count, float grad);
@@ -1,5 +1,7 @@
 #include "ftrl-model.h"
 #include "util/model-helpers.h"
+#include "util/simd.h"
+#include "util/sparse-gradients.h"
 
 #include <iostream>
 #include <iomanip>
@@ -30,9 +32,9 @@ public:
     }
 
     ~feature_buffer() {
-        free(indices);
-        free(values);
-        free(weights);
+        free_aligned(indices);
+        free_aligned(values);
+        free_aligned(weights);
     }
 
     void clear() {
@@ -49,13 +51,16 @@ public:
 
 static thread_local feature_buffer local_feature_buffer;
 
+static thread_local sparse_gradients local_gradients; // Gradients by weight index, when updates are aggregated
 
-ftrl_model::ftrl_model(uint n_bits, float alpha, float beta, float l1, float l2) {
+
+ftrl_model::ftrl_model(uint n_bits, float alpha, float beta, float l1, float l2, bool aggregate_updates) {
     this->alpha = alpha;
     this->beta = beta;
     this->l1 = l1;
     this->l2 = l2;
     this->n_bits = n_bits;
+    this->aggregate_updates = aggregate_updates;
 
     n_weights = 1 << n_bits;
     mask = n_weights - 1;
@@ -68,8 +73,33 @@ ftrl_model::ftrl_model(uint n_bits, float alpha, float beta, float l1, float l2)
 }
 
 ftrl_model::~ftrl_model() {
-    free(weights_z);
-    free(weights_n);
+    free_aligned(weights_z);
+    free_aligned(weights_n);
+}
+
+
+void ftrl_model::save(ffm_checkpoint_writer & out) const {
+    out.write(n_bits);
+
+    out.write(alpha);
+    out.write(beta);
+    out.write(l1);
+    out.write(l2);
+
+    out.write_array(weights_z, n_weights);
+    out.write_array(weights_n, n_weights);
+}
+
+void ftrl_model::load(ffm_checkpoint_reader & in) {
+    in.expect(n_bits, "n_bits");
+
+    alpha = in.read<float>();
+    beta = in.read<float>();
+    l1 = in.read<float>();
+    l2 = in.read<float>();
+
+    in.read_array(weights_z, n_weights);
+    in.read_array(weights_n, n_weights);
 }
 
 
@@ -129,35 +159,43 @@ float ftrl_model::predict(const ffm_feature * start, const ffm_feature * end, ff
 void ftrl_model::update(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float grad, uint64_t * dropout_mask, float dropout_mult) {
     auto & feature_buf = local_feature_buffer;
 
-    uint feature_count = feature_buf.size;
+    if (aggregate_updates) {
+        auto & grads = local_gradients;
 
-    uint  * fi = feature_buf.indices;
-    float * fv = feature_buf.values;
-    float * fw = feature_buf.weights;
+        if (grads.size() == 0)
+            grads.clear(1);
 
-    float * n = weights_n;
+        for (uint i = 0; i < feature_buf.size; ++ i)
+            grads.row(feature_buf.indices[i])[0] += feature_buf.values[i] * grad;
 
-    __m256 ymm_alpha = _mm256_set1_ps(alpha);
-    __m256 ymm_grad = _mm256_set1_ps(grad);
+        return;
+    }
 
-    for (uint i = 0; i < feature_count; i += 8) {
-        __m256 ymm_n = _mm256_set_ps(n[fi[i + 7]], n[fi[i + 6]], n[fi[i + 5]], n[fi[i + 4]], n[fi[i + 3]], n[fi[i + 2]], n[fi[i + 1]], n[fi[i]]);
+    dispatch_simd([&](auto v) { this->update_simd<typename decltype(v)::type>(feature_buf.indices, feature_buf.values, feature_buf.weights, feature_buf.size, grad); });
+}
 
-        __m256 ymm_fg = _mm256_load_ps(fv + i) * ymm_grad;
-        __m256 ymm_fg_sqr = ymm_fg * ymm_fg;
 
-        __m256 ymm_sigma = (_mm256_sqrt_ps(ymm_n + ymm_fg_sqr) - _mm256_sqrt_ps(ymm_n)) / ymm_alpha;
+// Single ftrl step of each weight by its gradient summed over mini-batch, with weight computed from current state
+void ftrl_model::merge_thread_updates() {
+    if (!aggregate_updates)
+        return;
 
-        __m256 ymm_za = ymm_fg - ymm_sigma * _mm256_load_ps(fw + i);
+    auto & grads = local_gradients;
 
-        float * za = (float *)(&ymm_za);
-        float * gs = (float *)(&ymm_fg_sqr);
+    for (uint r = 0; r < grads.size(); ++ r) {
+        uint feature_index = grads.key(r);
+        float g = grads.data(r)[0];
 
-        uint fl = min(8u, feature_count - i);
+        float zi = weights_z[feature_index];
+        float ni = weights_n[feature_index];
+        float zsi = sgn(zi);
 
-        for (uint j = 0; j < fl; ++ j) {
-            weights_z[fi[i + j]] += za[j];
-            weights_n[fi[i + j]] += gs[j];
-        }
+        float wi = zsi * zi < l1 ? 0 : (zsi * l1 - zi) / ((beta + sqrt(ni)) / alpha + l2);
+        float sigma = (sqrt(ni + g * g) - sqrt(ni)) / alpha;
+
+        weights_z[feature_index] = zi + g - sigma * wi;
+        weights_n[feature_index] = ni + g * g;
     }
+
+    grads.clear(1);
 }
@@ -9,12 +9,33 @@ class ftrl_model {
     float alpha, beta, l1, l2;
 
     uint n_bits, n_weights, mask;
+
+    bool aggregate_updates; // Accumulate gradients of weights over mini-batch and update each touched one once
+
+    // Kernel for instruction set V, instantiated in its kernel object
+    template <typename V>
+    void update_simd(const uint * fi, const float * fv, const float * fw, uint feature_count, float grad);
 public:
-    ftrl_model(uint n_bits, float alpha, float beta, float l1, float l2);
+    ftrl_model(uint n_bits, float alpha, float beta, float l1, float l2, bool aggregate_updates = false);
     ~ftrl_model();
 
     ffm_float predict(const ffm_feature * start, const ffm_feature * end, ffm_float norm, uint64_t * dropout_mask, float dropout_mult);
     void update(const ffm_feature * start, const ffm_feature * end, ffm_float norm, ffm_float kappa, uint64_t * dropout_mask, float dropout_mult);
 
     uint get_dropout_mask_size(const ffm_feature * start, const ffm_feature * end) { return 0; }
+
+    // Apply gradients accumulated by current thread when updates are aggregated, called after each mini-batch
+    void merge_thread_updates();
+
+    void flush_thread_updates() {} // Nothing is queued between threads
+
+    // Batched training is supported only by models with dense layers
+    void predict_batch(ffm_batch_example *, uint, float, float *) { throw std::runtime_error("Batched training is not supported by ftrl model"); }
+    void update_batch(const ffm_batch_example *, uint, float) { throw std::runtime_error("Batched training is not supported by ftrl model"); }
+
+    // Group-shared prediction is supported only by ffm model
+    void predict_group(ffm_batch_example *, uint, float, float *) { throw std::runtime_error("Group-shared prediction is not supported by ftrl model"); }
+
+    void save(ffm_checkpoint_writer & out) const;
+    void load(ffm_checkpoint_reader & in);
 };
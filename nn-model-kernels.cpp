@@ -0,0 +1,375 @@
+#include "nn-model-kernels.h"
+#include "util/nn-helpers.h"
+
+// Prediction and update kernels of nn model, compiled once per instruction set SIMD_ISA
+
+
+// Local to kernel object, as nn and ffm-nn models have different buffers of the same name
+namespace {
+
+class state_buffer {
+public:
+    float * l0_output;
+    float * l0_output_grad;
+    float * l0_dropout_mask;
+
+    float * l1_output;
+    float * l1_output_grad;
+    float * l1_dropout_mask;
+
+    float * l2_output;
+    float * l2_output_grad;
+    float * l2_dropout_mask;
+
+    std::default_random_engine gen;
+public:
+    state_buffer() {
+        l0_output = malloc_aligned<float>(l0_output_size);
+        l0_output_grad = malloc_aligned<float>(l0_output_size);
+        l0_dropout_mask = malloc_aligned<float>(l0_output_size);
+
+        l1_output = malloc_aligned<float>(l1_output_size);
+        l1_output_grad = malloc_aligned<float>(l1_output_size);
+        l1_dropout_mask = malloc_aligned<float>(l1_output_size);
+
+        l2_output = malloc_aligned<float>(l2_output_size);
+        l2_output_grad = malloc_aligned<float>(l2_output_size);
+        l2_dropout_mask = malloc_aligned<float>(l2_output_size);
+    }
+
+    ~state_buffer() {
+        free_aligned(l0_output);
+        free_aligned(l0_output_grad);
+        free_aligned(l0_dropout_mask);
+
+        free_aligned(l1_output);
+        free_aligned(l1_output_grad);
+        free_aligned(l1_dropout_mask);
+
+        free_aligned(l2_output);
+        free_aligned(l2_output_grad);
+        free_aligned(l2_dropout_mask);
+    }
+};
+
+}
+
+static thread_local state_buffer local_state_buffer;
+
+
+// Buffers of batched kernels, matrices with row per mini-batch example
+namespace {
+
+class batch_state_buffer {
+public:
+    float * l0_output;
+    float * l0_output_grad;
+    float * l0_dropout_mask;
+
+    float * l1_output;
+    float * l1_output_grad;
+    float * l1_dropout_mask;
+
+    float * l2_output;
+    float * l2_output_grad;
+    float * l2_dropout_mask;
+
+    float * kappas;
+public:
+    batch_state_buffer() {
+        l0_output = malloc_aligned<float>(mini_batch_size * l0_output_size);
+        l0_output_grad = malloc_aligned<float>(mini_batch_size * l0_output_size);
+        l0_dropout_mask = malloc_aligned<float>(mini_batch_size * l0_output_size);
+
+        l1_output = malloc_aligned<float>(mini_batch_size * l1_output_size);
+        l1_output_grad = malloc_aligned<float>(mini_batch_size * l1_output_size);
+        l1_dropout_mask = malloc_aligned<float>(mini_batch_size * l1_output_size);
+
+        l2_output = malloc_aligned<float>(mini_batch_size * l2_output_size);
+        l2_output_grad = malloc_aligned<float>(mini_batch_size * l2_output_size);
+        l2_dropout_mask = malloc_aligned<float>(mini_batch_size * l2_output_size);
+
+        kappas = malloc_aligned<float>(mini_batch_size);
+    }
+
+    ~batch_state_buffer() {
+        free_aligned(l0_output);
+        free_aligned(l0_output_grad);
+        free_aligned(l0_dropout_mask);
+
+        free_aligned(l1_output);
+        free_aligned(l1_output_grad);
+        free_aligned(l1_dropout_mask);
+
+        free_aligned(l2_output);
+        free_aligned(l2_output_grad);
+        free_aligned(l2_dropout_mask);
+
+        free_aligned(kappas);
+    }
+};
+
+}
+
+static thread_local batch_state_buffer local_batch_state_buffer;
+
+
+// Sum of feature embeddings, layer 0 output before activation
+template <typename V>
+static void embed_features(const float * lin_w, const ffm_feature * start, const ffm_feature * end, float * l0_output) {
+    typedef typename V::vec vec;
+
+    float linear_norm = end - start;
+
+    fill_with_zero(l0_output, l0_output_size);
+
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        uint index = rehash(fa->index);
+        float value = fa->value;
+
+        const float * wl = lin_w + index * l0_output_size;
+
+        vec v_val = V::set1(value / linear_norm);
+        for(ffm_uint d = 0; d < l0_output_size; d += V::width) {
+            uint n = simd_lanes<V>(d, l0_output_size);
+
+            V::store(l0_output + d,  V::fmadd(V::load(wl + d, n), v_val, V::load(l0_output + d, n)), n);
+        }
+    }
+}
+
+
+// AdaGrad update of feature embeddings by gradient of layer 0 output
+template <typename V>
+static void update_embeddings(float * lin_w, float * lin_wg, const ffm_feature * start, const ffm_feature * end, const float * l0_output_grad, float eta, float lambda) {
+    typedef typename V::vec vec;
+
+    float linear_norm = end - start;
+
+    vec v_eta = V::set1(eta);
+    vec v_lambda = V::set1(lambda);
+
+    for (const ffm_feature * fa = start; fa != end; ++ fa) {
+        uint index = rehash(fa->index);
+        float value = fa->value;
+
+        float * wl = lin_w + index * l0_output_size;
+        float * wgl = lin_wg + index * l0_output_size;
+
+        vec v_val = V::set1(value / linear_norm);
+
+        for (uint d = 0; d < l0_output_size; d += V::width) {
+            uint n = simd_lanes<V>(d, l0_output_size);
+
+            vec v_kappa_val = V::load(l0_output_grad + d, n) * v_val;
+
+            // Load weights
+            vec v_wl = V::load(wl + d, n);
+            vec v_wgl = V::load(wgl + d, n);
+
+            // Compute gradient values
+            vec v_g  = V::fmadd(v_lambda, v_wl, v_kappa_val);
+
+            // Update weights
+            v_wgl = V::fmadd(v_g, v_g, v_wgl);
+            v_wl  = V::fnmadd(v_eta * v_g, V::rsqrt(v_wgl), v_wl);
+
+            // Store weights
+            V::store(wl + d, v_wl, n);
+            V::store(wgl + d, v_wgl, n);
+        }
+    }
+}
+
+
+template <typename V>
+float nn_model::predict_simd(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * _dropout_mask, float dropout_mult) {
+    state_buffer & buf = local_state_buffer;
+
+    float * l0_output = buf.l0_output;
+    float * l0_dropout_mask = buf.l0_dropout_mask;
+
+    float * l1_output = buf.l1_output;
+    float * l1_dropout_mask = buf.l1_dropout_mask;
+
+    float * l2_output = buf.l2_output;
+    float * l2_dropout_mask = buf.l2_dropout_mask;
+
+    auto & gen = buf.gen;
+
+    // Prepare dropout masks, applied only in train
+    fill_dropout_mask(l0_dropout_mask, l0_output_size, 0, dropout_mult, gen);
+    fill_dropout_mask(l1_dropout_mask, l1_output_size, 0, dropout_mult, gen);
+    fill_dropout_mask(l2_dropout_mask, l2_output_size, 0, dropout_mult, gen);
+
+    // Compute activations
+    embed_features<V>(lin_w, start, end, l0_output);
+
+    l0_output[0] = 1.0; // Layer 0 bias, here we rewritre some computation results, but who cares
+    l1_output[0] = 1.0; // Layer 1 bias
+    l2_output[0] = 1.0; // Layer 2 bias
+
+    // Layer 0 relu
+    for (uint j = 1; j < l0_output_size; ++ j)
+        l0_output[j] = relu(l0_output[j]) * l0_dropout_mask[j];
+
+    // Dense layers, copies of current thread when they are replicated
+    float * const * dense_layers = dense->read_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l2_w = dense_layers[2];
+    float * l3_w = dense_layers[4];
+
+    // Layer 1 forward pass
+    for (uint j = 1; j < l1_output_size; ++ j)
+        l1_output[j] = relu(forward_pass<V>(l0_output_size, l0_output, l1_w + (j - 1) * l0_output_size)) * l1_dropout_mask[j];
+
+    // Layer 2 forward pass
+    for (uint j = 1; j < l2_output_size; ++ j)
+        l2_output[j] = relu(forward_pass<V>(l1_output_size, l1_output, l2_w + (j - 1) * l1_output_size)) * l2_dropout_mask[j];
+
+    // Layer 3 forward pass
+    return forward_pass<V>(l2_output_size, l2_output, l3_w);
+}
+
+
+template <typename V>
+void nn_model::update_simd(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * _dropout_mask, float _dropout_mult) {
+    state_buffer & buf = local_state_buffer;
+
+    float * l0_output = buf.l0_output;
+    float * l0_output_grad = buf.l0_output_grad;
+    float * l0_dropout_mask = buf.l0_dropout_mask;
+
+    float * l1_output = buf.l1_output;
+    float * l1_output_grad = buf.l1_output_grad;
+    float * l1_dropout_mask = buf.l1_dropout_mask;
+
+    float * l2_output = buf.l2_output;
+    float * l2_output_grad = buf.l2_output_grad;
+    float * l2_dropout_mask = buf.l2_dropout_mask;
+
+    fill_with_zero(l0_output_grad, l0_output_size);
+    fill_with_zero(l1_output_grad, l1_output_size);
+    fill_with_zero(l2_output_grad, l2_output_size);
+
+    float * const * dense_layers = dense->update_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l1_wg = dense_layers[1];
+    float * l2_w = dense_layers[2];
+    float * l2_wg = dense_layers[3];
+    float * l3_w = dense_layers[4];
+    float * l3_wg = dense_layers[5];
+
+    backward_pass<V>(l2_output_size, l2_output, l2_output_grad, l3_w, l3_wg, kappa, eta, lambda);
+
+    // Backprop layer 2
+    for (uint j = 1, ofs = 0; j < l2_output_size; ++ j, ofs += l1_output_size) {
+        float l2_grad = l2_output_grad[j] * l2_dropout_mask[j];
+
+        if (l2_output[j] <= 0) // Relu activation: grad in negative part is zero
+            l2_grad = 0;
+
+        backward_pass<V>(l1_output_size, l1_output, l1_output_grad, l2_w + ofs, l2_wg + ofs, l2_grad, eta, lambda);
+    }
+
+    // Backprop layer 1
+    for (uint j = 1, ofs = 0; j < l1_output_size; ++ j, ofs += l0_output_size) {
+        float l1_grad = l1_output_grad[j] * l1_dropout_mask[j];
+
+        if (l1_output[j] <= 0) // Relu activation: grad in negative part is zero
+            l1_grad = 0;
+
+        backward_pass<V>(l0_output_size, l0_output, l0_output_grad, l1_w + ofs, l1_wg + ofs, l1_grad, eta, lambda);
+    }
+
+    // Backprop layer 0
+    l0_output_grad[0] = 0;
+    for (uint j = 1; j < l0_output_size; ++ j) {
+        float l0_grad = l0_output_grad[j] * l0_dropout_mask[j];
+
+        if (l0_output[j] <= 0) // Relu activation: grad in negative part is zero
+            l0_grad = 0;
+
+        l0_output_grad[j] = l0_grad;
+    }
+
+    // Update linear and interaction weights
+    update_embeddings<V>(lin_w, lin_wg, start, end, l0_output_grad, eta, lambda);
+}
+
+
+template <typename V>
+void nn_model::predict_batch_simd(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions) {
+    batch_state_buffer & buf = local_batch_state_buffer;
+    auto & gen = local_state_buffer.gen;
+
+    // Embeddings and dropout masks of each example, in the same order as unbatched kernels take them
+    for (uint i = 0; i < n; ++ i) {
+        fill_dropout_mask(buf.l0_dropout_mask + i * l0_output_size, l0_output_size, 0, dropout_mult, gen);
+        fill_dropout_mask(buf.l1_dropout_mask + i * l1_output_size, l1_output_size, 0, dropout_mult, gen);
+        fill_dropout_mask(buf.l2_dropout_mask + i * l2_output_size, l2_output_size, 0, dropout_mult, gen);
+
+        embed_features<V>(lin_w, examples[i].start, examples[i].end, buf.l0_output + i * l0_output_size);
+    }
+
+    activate_batch(n, l0_output_size, buf.l0_output, buf.l0_dropout_mask);
+
+    float * const * dense_layers = dense->read_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l2_w = dense_layers[2];
+    float * l3_w = dense_layers[4];
+
+    // Dense layers as matrix products, outputs after bias column
+    forward_pass_batch<V>(n, l0_output_size, buf.l0_output, l1_output_size - 1, l1_w, buf.l1_output + 1, l1_output_size);
+    activate_batch(n, l1_output_size, buf.l1_output, buf.l1_dropout_mask);
+
+    forward_pass_batch<V>(n, l1_output_size, buf.l1_output, l2_output_size - 1, l2_w, buf.l2_output + 1, l2_output_size);
+    activate_batch(n, l2_output_size, buf.l2_output, buf.l2_dropout_mask);
+
+    forward_pass_batch<V>(n, l2_output_size, buf.l2_output, 1, l3_w, predictions, 1);
+}
+
+
+template <typename V>
+void nn_model::update_batch_simd(const ffm_batch_example * examples, uint n, float) {
+    batch_state_buffer & buf = local_batch_state_buffer;
+
+    for (uint i = 0; i < n; ++ i)
+        buf.kappas[i] = examples[i].kappa;
+
+    fill_with_zero(buf.l0_output_grad, n * l0_output_size);
+    fill_with_zero(buf.l1_output_grad, n * l1_output_size);
+    fill_with_zero(buf.l2_output_grad, n * l2_output_size);
+
+    float * const * dense_layers = dense->update_arrays();
+
+    float * l1_w = dense_layers[0];
+    float * l1_wg = dense_layers[1];
+    float * l2_w = dense_layers[2];
+    float * l2_wg = dense_layers[3];
+    float * l3_w = dense_layers[4];
+    float * l3_wg = dense_layers[5];
+
+    // Backprop dense layers with single update of their weights per mini-batch
+    backward_pass_batch<V>(n, l2_output_size, buf.l2_output, buf.l2_output_grad, 1, buf.kappas, 1, l3_w, l3_wg, eta, lambda);
+
+    activate_grad_batch(n, l2_output_size, buf.l2_output, buf.l2_output_grad, buf.l2_dropout_mask);
+    backward_pass_batch<V>(n, l1_output_size, buf.l1_output, buf.l1_output_grad, l2_output_size - 1, buf.l2_output_grad + 1, l2_output_size, l2_w, l2_wg, eta, lambda);
+
+    activate_grad_batch(n, l1_output_size, buf.l1_output, buf.l1_output_grad, buf.l1_dropout_mask);
+    backward_pass_batch<V>(n, l0_output_size, buf.l0_output, buf.l0_output_grad, l1_output_size - 1, buf.l1_output_grad + 1, l1_output_size, l1_w, l1_wg, eta, lambda);
+
+    activate_grad_batch(n, l0_output_size, buf.l0_output, buf.l0_output_grad, buf.l0_dropout_mask);
+
+    // Embeddings of each example are updated separately, as examples share few features
+    for (uint i = 0; i < n; ++ i)
+        update_embeddings<V>(lin_w, lin_wg, examples[i].start, examples[i].end, buf.l0_output_grad + i * l0_output_size, eta, lambda);
+}
+
+template float nn_model::predict_simd<SIMD_ISA>(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+template void nn_model::update_simd<SIMD_ISA>(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+template void nn_model::predict_batch_simd<SIMD_ISA>(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+template void nn_model::update_batch_simd<SIMD_ISA>(const ffm_batch_example * examples, uint n, float dropout_mult);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "nn-model.h"
+#include "util/model-helpers.h"
+
+// Layer sizes of nn model, shared by model and its kernel objects
+
+
+constexpr uint n_features = 1 << ffm_hash_bits;
+
+constexpr uint l0_output_size = aligned_float_array_size(96);
+constexpr uint l1_output_size = aligned_float_array_size(64);
+constexpr uint l2_output_size = aligned_float_array_size(48);
+
+constexpr uint l1_layer_size = l0_output_size * (l1_output_size - 1);
+constexpr uint l2_layer_size = l1_output_size * (l2_output_size - 1);
+constexpr uint l3_layer_size = l2_output_size;
+
+
+
+inline uint rehash(uint feature_index) {
+    return feature_index &  ffm_hash_mask;
+}
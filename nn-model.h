@@ -2,6 +2,8 @@
 
 #include "ffm.h"
 
+class dense_replicas;
+
 class nn_model {
     float * lin_w;
     float * lin_wg;
@@ -15,17 +17,48 @@ class nn_model {
     float * l3_w;
     float * l3_wg;
 
+    dense_replicas * dense; // Per-thread copies of dense layers in training, if enabled
+
     float eta;
     float lambda;
 
     uint max_b_field;
     uint min_a_field;
+
+    // Kernels for instruction set V, instantiated in its kernel object
+    template <typename V>
+    float predict_simd(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V>
+    void update_simd(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
+
+    template <typename V>
+    void predict_batch_simd(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+
+    template <typename V>
+    void update_batch_simd(const ffm_batch_example * examples, uint n, float dropout_mult);
 public:
-    nn_model(int seed, float eta, float lambda);
+    nn_model(int seed, float eta, float lambda, bool replicate_dense = false);
     ~nn_model();
 
     float predict(const ffm_feature * start, const ffm_feature * end, float norm, uint64_t * dropout_mask, float dropout_mult);
     void update(const ffm_feature * start, const ffm_feature * end, float norm, float kappa, uint64_t * dropout_mask, float dropout_mult);
 
+    // Predict whole mini-batch with dense layers as matrix products, and update with single step of dense weights
+    // by gradients of all examples, given in their kappa after prediction
+    void predict_batch(ffm_batch_example * examples, uint n, float dropout_mult, float * predictions);
+    void update_batch(const ffm_batch_example * examples, uint n, float dropout_mult);
+
+    // Group-shared prediction is supported only by ffm model
+    void predict_group(ffm_batch_example *, uint, float, float *) { throw std::runtime_error("Group-shared prediction is not supported by nn model"); }
+
     uint get_dropout_mask_size(const ffm_feature * start, const ffm_feature * end);
+
+    // Merge changes made by current thread since last call into shared weights, called after each mini-batch
+    void merge_thread_updates();
+
+    void flush_thread_updates() {} // Nothing is queued between threads
+
+    void save(ffm_checkpoint_writer & out) const;
+    void load(ffm_checkpoint_reader & in);
 };
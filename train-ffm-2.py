@@ -21,12 +21,12 @@ def fit_predict(profile, split, split_name):
         if split_name != "full":
             opts += " --val %s" % pred_file
 
-        print_and_exec("bin/ffm %s --train %s --test %s --pred  /tmp/ffm2.preds" % (opts, train_file, pred_file))
+        print_and_exec("bin/ffm %s --train %s --test %s --pred /tmp/ffm2.preds.npy --pred-format npy" % (opts, train_file, pred_file))
 
         if pred is None:
-            pred = np.loadtxt('/tmp/ffm2.preds')
+            pred = np.load('/tmp/ffm2.preds.npy').astype(np.float64)
         else:
-            pred += np.loadtxt('/tmp/ffm2.preds')
+            pred += np.load('/tmp/ffm2.preds.npy')
 
     pred_df = pd.read_csv(split[1])
     pred_df['pred'] = pred / n_bags
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <cstdlib>
+#include <cstdint>
+
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+
+constexpr uint32_t align_bytes = 32;
+
+
+// Huge pages configuration, applied to allocations of at least huge_page_min_bytes
+
+enum class huge_pages_mode { none, thp, huge_2m, huge_1g };
+
+constexpr size_t huge_page_min_bytes = 2 << 20;
+
+
+inline huge_pages_mode & huge_pages() {
+    static huge_pages_mode mode = huge_pages_mode::none;
+    return mode;
+}
+
+
+// Pages are placed by memory policy of thread which touches them first. Numa policies are set only for the thread
+// which creates models, so while one is active their arrays should be initialized by it and not by worker threads
+inline bool & parallel_first_touch() {
+    static bool parallel = true;
+    return parallel;
+}
+
+
+// Registry of mmap-backed allocations: pointer -> (mapped size, page kind)
+class page_allocations {
+public:
+    std::mutex mutex;
+    std::map<void *, std::pair<size_t, std::string>> allocations;
+    std::map<std::string, size_t> bytes_by_page_kind;
+
+    static page_allocations & instance() {
+        static page_allocations registry;
+        return registry;
+    }
+
+    void add(void * ptr, size_t size, const std::string & page_kind) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        allocations[ptr] = std::make_pair(size, page_kind);
+        bytes_by_page_kind[page_kind] += size;
+    }
+
+    // Remove allocation and return its mapped size, or 0 if it's not mmap-backed
+    size_t remove(void * ptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it = allocations.find(ptr);
+
+        if (it == allocations.end())
+            return 0;
+
+        size_t size = it->second.first;
+
+        bytes_by_page_kind[it->second.second] -= size;
+        allocations.erase(it);
+
+        return size;
+    }
+};
+
+
+// Map memory using explicit huge pages of given size, returns nullptr if pool has not enough of them.
+// Pages are reserved on mapping (no MAP_NORESERVE), so missing ones cause failure here and not SIGBUS later
+inline void * mmap_huge_pages(size_t size, size_t page_size, int page_size_log) {
+    size_t mapped_size = (size + page_size - 1) / page_size * page_size;
+
+    void * ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_size_log << MAP_HUGE_SHIFT), -1, 0);
+
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    page_allocations::instance().add(ptr, mapped_size, page_size_log >= 30 ? std::to_string(page_size >> 30) + " GB pages" : std::to_string(page_size >> 20) + " MB pages");
+
+    return ptr;
+}
+
+
+// Map memory aligned to 2MB and ask kernel to back it with transparent huge pages
+inline void * mmap_thp(size_t size) {
+    const size_t page_size = 2 << 20;
+
+    size_t mapped_size = (size + page_size - 1) / page_size * page_size;
+
+    char * ptr = (char *) mmap(nullptr, mapped_size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    // Trim mapping to aligned range
+    char * aligned = (char *)(((uintptr_t) ptr + page_size - 1) / page_size * page_size);
+
+    if (aligned > ptr)
+        munmap(ptr, aligned - ptr);
+
+    if (aligned + mapped_size < ptr + mapped_size + page_size)
+        munmap(aligned + mapped_size, ptr + page_size - aligned);
+
+    // Kernel may ignore this hint if transparent huge pages are disabled
+    madvise(aligned, mapped_size, MADV_HUGEPAGE);
+
+    page_allocations::instance().add(aligned, mapped_size, "transparent huge pages");
+
+    return aligned;
+}
+
+
+// Allocate memory aligned for AVX, using huge pages for big allocations if enabled
+template <typename T>
+inline T * malloc_aligned(size_t size) {
+    size_t bytes = size * sizeof(T);
+    void * ptr = nullptr;
+
+    if (bytes >= huge_page_min_bytes) {
+        // Try requested page size, falling back to smaller ones
+        switch (huge_pages()) {
+        case huge_pages_mode::huge_1g:
+            if ((ptr = mmap_huge_pages(bytes, 1ul << 30, 30)) != nullptr)
+                break;
+            // fall through
+        case huge_pages_mode::huge_2m:
+            if ((ptr = mmap_huge_pages(bytes, 2ul << 20, 21)) != nullptr)
+                break;
+            // fall through
+        case huge_pages_mode::thp:
+            ptr = mmap_thp(bytes);
+            break;
+        case huge_pages_mode::none:
+            break;
+        }
+    }
+
+    if (ptr == nullptr) {
+        int status = posix_memalign(&ptr, align_bytes, bytes);
+
+        if(status != 0)
+            throw std::bad_alloc();
+    }
+
+    return (T*) ptr;
+}
+
+
+template <typename T>
+inline void free_aligned(T * ptr) {
+    size_t mapped_size = page_allocations::instance().remove((void *) ptr);
+
+    if (mapped_size > 0)
+        munmap((void *) ptr, mapped_size);
+    else
+        free((void *) ptr);
+}
+
+
+// Describe how much memory is allocated with each kind of huge pages
+inline std::string describe_huge_page_allocations() {
+    auto & registry = page_allocations::instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    std::string res;
+
+    for (auto it = registry.bytes_by_page_kind.begin(); it != registry.bytes_by_page_kind.end(); ++ it) {
+        if (it->second == 0)
+            continue;
+
+        if (!res.empty())
+            res += ", ";
+
+        res += std::to_string(it->second >> 20) + " MB in " + it->first;
+    }
+
+    return res.empty() ? "no huge pages used" : res;
+}
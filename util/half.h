@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+
+// Conversions between fp32 and 16-bit float formats: fp16 is IEEE half precision, bf16 is upper half of fp32 bits.
+// Implemented on integer bits, so they don't need F16C and give the same results as hardware conversions
+
+inline uint32_t float_bits(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+
+    return bits;
+}
+
+inline float bits_float(uint32_t bits) {
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+
+    return v;
+}
+
+
+// Convert fp32 bits to fp16 rounding to nearest even, or toward zero (then overflow saturates at max value)
+inline uint16_t fp32_bits_to_fp16(uint32_t bits, bool round_to_zero) {
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+
+    if (abs >= 0x7f800000) // Inf or nan, which stays nan
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 | ((abs >> 13) & 0x3ff) : 0);
+
+    if (abs >= (round_to_zero ? 0x47800000u : 0x477ff000u)) // At least 65536, or 65520 rounded to nearest
+        return sign | (round_to_zero ? 0x7bff : 0x7c00);
+
+    uint32_t res, rem, half;
+
+    if (abs >= 0x38800000) { // Normal, rebias exponent and drop 13 mantissa bits
+        res = (abs - 0x38000000) >> 13;
+        rem = abs & 0x1fff;
+        half = 0x1000;
+    } else { // Subnormal, shift mantissa with implicit bit
+        uint32_t shift = 126 - (abs >> 23);
+
+        if (shift > 24)
+            return sign;
+
+        uint32_t mant = (abs & 0x7fffff) | 0x800000;
+
+        res = mant >> shift;
+        rem = mant & ((1u << shift) - 1);
+        half = 1u << (shift - 1);
+    }
+
+    if (!round_to_zero && (rem > half || (rem == half && (res & 1))))
+        res ++; // Carry to exponent is correct rounding to next binade
+
+    return sign | res;
+}
+
+inline uint16_t float_to_fp16(float v) {
+    return fp32_bits_to_fp16(float_bits(v), false);
+}
+
+inline float fp16_to_float(uint16_t v) {
+    uint32_t sign = uint32_t(v & 0x8000) << 16;
+    uint32_t exp = (v >> 10) & 0x1f;
+    uint32_t mant = v & 0x3ff;
+
+    if (exp == 0x1f) // Inf or nan
+        return bits_float(sign | 0x7f800000 | (mant << 13));
+
+    if (exp == 0) // Zero or subnormal, exactly representable as normal fp32
+        return bits_float(sign | float_bits(mant * (1.0f / (1 << 24))));
+
+    return bits_float(sign | ((exp + 112) << 23) | (mant << 13));
+}
+
+inline uint16_t float_to_bf16(float v) {
+    uint32_t bits = float_bits(v);
+
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16; // Round to nearest even
+}
+
+inline float bf16_to_float(uint16_t v) {
+    return bits_float(uint32_t(v) << 16);
+}
+
+
+// Stochastic rounding: random bits are added to the dropped part of magnitude before truncation,
+// so value is rounded up with probability proportional to its distance from the lower one and small updates are not lost
+
+// Exact for normal fp16 numbers (13 dropped bits), fp16 subnormals are biased toward zero, overflow saturates at max value
+inline uint16_t float_to_fp16_stochastic(float v, uint32_t rnd) {
+    return fp32_bits_to_fp16(float_bits(v) + (rnd & 0x1fff), true);
+}
+
+inline uint16_t float_to_bf16_stochastic(float v, uint32_t rnd) {
+    return (float_bits(v) + (rnd & 0xffff)) >> 16;
+}
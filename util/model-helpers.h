@@ -2,72 +2,51 @@
 
 #include <random>
 
-#include <immintrin.h>
+#include "alloc.h"
+#include "random.h"
 
-// Define intrinsic missing in gcc
-#define _mm256_set_m128(v0, v1)  _mm256_insertf128_ps(_mm256_castps128_ps256(v1), (v0), 1)
 
-
-
-constexpr ffm_uint align_bytes = 32;
 constexpr ffm_uint align_floats = align_bytes / sizeof(float);
 
 
-inline float sum(__m256 val) {
-    __m128 s = _mm256_extractf128_ps(_mm256_add_ps(val,  _mm256_permute2f128_ps(val, val, 1)), 0);
-
-    s = _mm_hadd_ps(s, s);
-    s = _mm_hadd_ps(s, s);
-
-    float sum;
-    _mm_store_ss(&sum, s);
-
-    return sum;
-}
-
 constexpr uint aligned_float_array_size(uint cnt) {
     return ((cnt - 1) / align_floats + 1) * align_floats;
 }
 
 
-template <typename T>
-inline T * malloc_aligned(size_t size) {
-    void *ptr;
-
-    int status = posix_memalign(&ptr, align_bytes, size*sizeof(T));
+// Arrays bigger than this are filled in parallel, unless pages should be touched first by calling thread
+constexpr size_t parallel_fill_min_size = 1 << 16;
 
-    if(status != 0)
-        throw std::bad_alloc();
 
-    return (T*) ptr;
+template <typename T>
+inline void fill_with_zero(T * weights, size_t n) {
+    #pragma omp parallel for schedule(static) if (n >= parallel_fill_min_size && parallel_first_touch())
+    for(size_t i = 0; i < n; i++)
+        weights[i] = T(0);
 }
 
 
-template <typename T>
-inline void fill_with_zero(T * weights, size_t n) {
-    T * w = weights;
+// Random fills use counter-based generator keyed by (seed, position), so result doesn't depend on thread count
 
+inline void fill_with_rand_uniform(ffm_float * weights, size_t n, float min, float max, uint64_t seed) {
+    #pragma omp parallel for schedule(static) if (n >= parallel_fill_min_size && parallel_first_touch())
     for(size_t i = 0; i < n; i++)
-        *w++ = T(0);
+        weights[i] = counter_uniform(seed, i, min, max);
 }
 
 
-template <typename D>
-static void fill_with_rand(ffm_float * weights, ffm_uint n, D gen, std::default_random_engine & rnd) {
-    ffm_float * w = weights;
-
-    for(ffm_uint i = 0; i < n; i++) {
-        *w++ = gen(rnd);
-    }
+inline void fill_with_rand_normal(ffm_float * weights, size_t n, float mean, float stddev, uint64_t seed) {
+    #pragma omp parallel for schedule(static) if (n >= parallel_fill_min_size && parallel_first_touch())
+    for(size_t i = 0; i < n; i++)
+        weights[i] = counter_normal(seed, i, mean, stddev);
 }
 
 
 template <typename T>
 inline void fill_with_ones(T * weights, size_t n) {
-    T * w = weights;
-
+    #pragma omp parallel for schedule(static) if (n >= parallel_fill_min_size && parallel_first_touch())
     for(size_t i = 0; i < n; i++)
-        *w++ = T(1);
+        weights[i] = T(1);
 }
 
 
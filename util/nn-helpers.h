@@ -1,31 +1,323 @@
 #pragma once
 
 #include "model-helpers.h"
+#include "simd.h"
+#include "alloc.h"
 
+#include <vector>
+#include <mutex>
+#include <random>
+#include <cstring>
 
+#include <omp.h>
+
+
+template <typename V>
 inline void backward_pass(uint input_size, float * input, float * input_grad, float * w, float * wg, float grad, float eta, float lambda) {
-    __m256 ymm_eta = _mm256_set1_ps(eta);
-    __m256 ymm_lambda = _mm256_set1_ps(lambda);
-    __m256 ymm_grad = _mm256_set1_ps(grad);
+    typedef typename V::vec vec;
+
+    vec v_eta = V::set1(eta);
+    vec v_lambda = V::set1(lambda);
+    vec v_grad = V::set1(grad);
 
-    for (uint i = 0; i < input_size; i += 8) {
-        __m256 ymm_w = _mm256_load_ps(w + i);
+    for (uint i = 0; i < input_size; i += V::width) {
+        uint n = simd_lanes<V>(i, input_size);
 
-        __m256 ymm_g = ymm_lambda * ymm_w + ymm_grad * _mm256_load_ps(input + i);
-        __m256 ymm_wg = _mm256_load_ps(wg + i) + ymm_g * ymm_g;
+        vec v_w = V::load(w + i, n);
 
-        _mm256_store_ps(input_grad + i, ymm_grad * ymm_w + _mm256_load_ps(input_grad + i));
+        vec v_g = V::fmadd(v_lambda, v_w, v_grad * V::load(input + i, n));
+        vec v_wg = V::fmadd(v_g, v_g, V::load(wg + i, n));
 
-        _mm256_store_ps(w + i, ymm_w - ymm_eta * ymm_g * _mm256_rsqrt_ps(ymm_wg));
-        _mm256_store_ps(wg + i, ymm_wg);
+        V::store(input_grad + i, V::fmadd(v_grad, v_w, V::load(input_grad + i, n)), n);
+
+        V::store(w + i, V::fnmadd(v_eta * v_g, V::rsqrt(v_wg), v_w), n);
+        V::store(wg + i, v_wg, n);
     }
 }
 
+template <typename V>
 inline float forward_pass(uint input_size, float * input, float * w) {
-    __m256 ymm_total = _mm256_set1_ps(0);
+    typename V::vec v_total = V::zero();
+
+    for (uint i = 0; i < input_size; i += V::width) {
+        uint n = simd_lanes<V>(i, input_size);
+
+        v_total = V::fmadd(V::load(input + i, n), V::load(w + i, n), v_total);
+    }
+
+    return V::sum(v_total);
+}
+
+
+// Dropout mask of layer outputs in train (dropout_mult > 1), where kept outputs are scaled to preserve mean,
+// and ones otherwise. No dropout on bias in first element
+inline void fill_dropout_mask(float * mask, uint size, float dropout_prob, float dropout_mult, std::default_random_engine & gen) {
+    if (dropout_mult > 1) {
+        std::uniform_real_distribution<float> dropout_distr(0, 1);
+
+        float dropout_scale = 1 / (1 - dropout_prob);
+
+        mask[0] = 1.0;
+        for (uint j = 1; j < size; ++ j)
+            mask[j] = (dropout_distr(gen) >= dropout_prob) * dropout_scale;
+    } else {
+        fill_with_ones(mask, size);
+    }
+}
+
+
+// Batched passes over mini-batch of n examples. Layer inputs, outputs and their gradients are matrices with row per example,
+// weights have row of input_size per output. First element of hidden layer output is bias input of next layer.
+
+// Relu activation with dropout of n rows of layer outputs
+inline void activate_batch(uint n, uint size, float * output, const float * dropout_mask) {
+    for (uint i = 0; i < n; ++ i) {
+        float * row = output + i * size;
+        const float * mask = dropout_mask + i * size;
+
+        row[0] = 1.0;
+        for (uint j = 1; j < size; ++ j)
+            row[j] = relu(row[j]) * mask[j];
+    }
+}
+
+// Gradients of n rows of layer outputs before activation, zero for bias and in negative part of relu
+inline void activate_grad_batch(uint n, uint size, const float * output, float * grad, const float * dropout_mask) {
+    for (uint i = 0; i < n; ++ i) {
+        const float * row = output + i * size;
+        const float * mask = dropout_mask + i * size;
+        float * row_grad = grad + i * size;
+
+        row_grad[0] = 0;
+        for (uint j = 1; j < size; ++ j)
+            row_grad[j] = row[j] > 0 ? row_grad[j] * mask[j] : 0;
+    }
+}
+
+
+// Dot products of R input rows with C weight rows, accumulated in registers
+template <typename V, uint R, uint C>
+inline void forward_block(uint input_size, const float * input, const float * w, float * output, uint output_stride) {
+    typedef typename V::vec vec;
+
+    vec v_total[R][C];
+
+    for (uint r = 0; r < R; ++ r)
+        for (uint c = 0; c < C; ++ c)
+            v_total[r][c] = V::zero();
+
+    for (uint k = 0; k < input_size; k += V::width) {
+        uint m = simd_lanes<V>(k, input_size);
+
+        vec v_in[R];
+
+        for (uint r = 0; r < R; ++ r)
+            v_in[r] = V::load(input + r * input_size + k, m);
+
+        for (uint c = 0; c < C; ++ c) {
+            vec v_w = V::load(w + c * input_size + k, m);
+
+            for (uint r = 0; r < R; ++ r)
+                v_total[r][c] = V::fmadd(v_in[r], v_w, v_total[r][c]);
+        }
+    }
+
+    for (uint r = 0; r < R; ++ r)
+        for (uint c = 0; c < C; ++ c)
+            output[r * output_stride + c] = V::sum(v_total[r][c]);
+}
+
+// Forward pass of dense layer: output[i * output_stride + j] = dot(input row i, weight row j) for j < n_outputs,
+// computed in blocks of 4 examples by 2 outputs, so each loaded weight is used 4 times. Sums are the same as of forward_pass
+template <typename V>
+inline void forward_pass_batch(uint n, uint input_size, const float * input, uint n_outputs, const float * w, float * output, uint output_stride) {
+    uint i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        uint j = 0;
+
+        for (; j + 2 <= n_outputs; j += 2)
+            forward_block<V, 4, 2>(input_size, input + i * input_size, w + j * input_size, output + i * output_stride + j, output_stride);
+
+        for (; j < n_outputs; ++ j)
+            forward_block<V, 4, 1>(input_size, input + i * input_size, w + j * input_size, output + i * output_stride + j, output_stride);
+    }
+
+    for (; i < n; ++ i)
+        for (uint j = 0; j < n_outputs; ++ j)
+            forward_block<V, 1, 1>(input_size, input + i * input_size, w + j * input_size, output + i * output_stride + j, output_stride);
+}
+
+
+// Input gradients of R examples, accumulated in registers over all outputs
+template <typename V, uint R>
+inline void backward_input_block(uint input_size, float * input_grad, uint n_outputs, const float * grad, uint grad_stride, const float * w) {
+    typedef typename V::vec vec;
+
+    for (uint k = 0; k < input_size; k += V::width) {
+        uint m = simd_lanes<V>(k, input_size);
+
+        vec v_input_grad[R];
 
-    for (uint i = 0; i < input_size; i += 8)
-        ymm_total += _mm256_load_ps(input + i) * _mm256_load_ps(w + i);
+        for (uint r = 0; r < R; ++ r)
+            v_input_grad[r] = V::load(input_grad + r * input_size + k, m);
 
-    return sum(ymm_total);
+        for (uint j = 0; j < n_outputs; ++ j) {
+            vec v_w = V::load(w + j * input_size + k, m);
+
+            for (uint r = 0; r < R; ++ r)
+                v_input_grad[r] = V::fmadd(V::set1(grad[r * grad_stride + j]), v_w, v_input_grad[r]);
+        }
+
+        for (uint r = 0; r < R; ++ r)
+            V::store(input_grad + r * input_size + k, v_input_grad[r], m);
+    }
+}
+
+// AdaGrad step of C weight rows by gradient summed over n examples, each loaded input is used for all rows
+template <typename V, uint C>
+inline void backward_weights_block(uint n, uint input_size, const float * input, const float * grad, uint grad_stride, float * w, float * wg, float eta, float lambda) {
+    typedef typename V::vec vec;
+
+    vec v_eta = V::set1(eta);
+    vec v_lambda = V::set1(lambda * n); // Regularization of each example
+
+    for (uint k = 0; k < input_size; k += V::width) {
+        uint m = simd_lanes<V>(k, input_size);
+
+        vec v_w[C], v_g[C];
+
+        for (uint c = 0; c < C; ++ c) {
+            v_w[c] = V::load(w + c * input_size + k, m);
+            v_g[c] = v_lambda * v_w[c];
+        }
+
+        for (uint r = 0; r < n; ++ r) {
+            vec v_in = V::load(input + r * input_size + k, m);
+
+            for (uint c = 0; c < C; ++ c)
+                v_g[c] = V::fmadd(V::set1(grad[r * grad_stride + c]), v_in, v_g[c]);
+        }
+
+        for (uint c = 0; c < C; ++ c) {
+            vec v_wg = V::fmadd(v_g[c], v_g[c], V::load(wg + c * input_size + k, m));
+
+            V::store(w + c * input_size + k, V::fnmadd(v_eta * v_g[c], V::rsqrt(v_wg), v_w[c]), m);
+            V::store(wg + c * input_size + k, v_wg, m);
+        }
+    }
+}
+
+// Backward pass of dense layer with output gradients grad[i * grad_stride + j]: input gradients are accumulated
+// with weights before update, then weights get single AdaGrad step by gradient summed over examples
+template <typename V>
+inline void backward_pass_batch(uint n, uint input_size, const float * input, float * input_grad, uint n_outputs, const float * grad, uint grad_stride, float * w, float * wg, float eta, float lambda) {
+    uint i = 0;
+
+    for (; i + 4 <= n; i += 4)
+        backward_input_block<V, 4>(input_size, input_grad + i * input_size, n_outputs, grad + i * grad_stride, grad_stride, w);
+
+    for (; i < n; ++ i)
+        backward_input_block<V, 1>(input_size, input_grad + i * input_size, n_outputs, grad + i * grad_stride, grad_stride, w);
+
+    uint j = 0;
+
+    for (; j + 4 <= n_outputs; j += 4)
+        backward_weights_block<V, 4>(n, input_size, input, grad + j, grad_stride, w + j * input_size, wg + j * input_size, eta, lambda);
+
+    for (; j < n_outputs; ++ j)
+        backward_weights_block<V, 1>(n, input_size, input, grad + j, grad_stride, w + j * input_size, wg + j * input_size, eta, lambda);
 }
+
+
+// Per-thread copies of dense layer arrays for training. Thread updates its copy, and after each mini-batch
+// change of the copy since it was taken is added to shared arrays, so threads don't write the same cache lines
+// on every example. Without copies (or outside of their thread team) shared arrays are used directly.
+class dense_replicas {
+    struct replica {
+        std::vector<float *> arrays;
+        std::vector<float *> origins; // Values of arrays when copied from shared ones
+        bool active = false; // Has changes not added to shared arrays yet
+    };
+
+    std::vector<float *> shared;
+    std::vector<uint> sizes;
+
+    std::vector<replica> replicas;
+    std::mutex merge_mutex;
+public:
+    dense_replicas(bool enabled): replicas(enabled ? omp_get_max_threads() : 0) {}
+
+    ~dense_replicas() {
+        for (auto r = replicas.begin(); r != replicas.end(); ++ r) {
+            for (uint k = 0; k < r->arrays.size(); ++ k) {
+                free_aligned(r->arrays[k]);
+                free_aligned(r->origins[k]);
+            }
+        }
+    }
+
+    // Register shared array, arrays are returned in order of registration
+    void add(float * array, uint size) {
+        shared.push_back(array);
+        sizes.push_back(size);
+    }
+
+    // Arrays to read by current thread: its copy if it has unmerged changes, shared ones otherwise
+    float * const * read_arrays() {
+        replica * r = thread_replica();
+
+        return r != nullptr && r->active ? r->arrays.data() : shared.data();
+    }
+
+    // Arrays to update by current thread, taking copy of shared ones on first update after merge
+    float * const * update_arrays() {
+        replica * r = thread_replica();
+
+        if (r == nullptr)
+            return shared.data();
+
+        if (!r->active) {
+            for (uint k = 0; k < shared.size(); ++ k) {
+                if (r->arrays.size() == k) {
+                    r->arrays.push_back(malloc_aligned<float>(sizes[k]));
+                    r->origins.push_back(malloc_aligned<float>(sizes[k]));
+                }
+
+                memcpy(r->arrays[k], shared[k], sizes[k] * sizeof(float));
+                memcpy(r->origins[k], r->arrays[k], sizes[k] * sizeof(float));
+            }
+
+            r->active = true;
+        }
+
+        return r->arrays.data();
+    }
+
+    // Add changes of current thread copy to shared arrays
+    void merge() {
+        replica * r = thread_replica();
+
+        if (r == nullptr || !r->active)
+            return;
+
+        std::lock_guard<std::mutex> lock(merge_mutex);
+
+        for (uint k = 0; k < shared.size(); ++ k) {
+            float * s = shared[k];
+            const float * a = r->arrays[k];
+            const float * o = r->origins[k];
+
+            for (uint i = 0; i < sizes[k]; ++ i)
+                s[i] += a[i] - o[i];
+        }
+
+        r->active = false;
+    }
+private:
+    replica * thread_replica() {
+        uint t = omp_get_thread_num();
+
+        return t < replicas.size() ? &replicas[t] : nullptr;
+    }
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <omp.h>
+
+#include "alloc.h"
+
+
+// Parse kernel cpu / node list like "0-15,32-47"
+inline std::vector<uint> parse_numa_list(const std::string & list) {
+    std::vector<uint> res;
+    std::stringstream ss(list);
+    std::string item;
+
+    while (std::getline(ss, item, ',')) {
+        if (item.empty() || item == "\n")
+            continue;
+
+        auto dash = item.find('-');
+        uint from = std::stoul(item.substr(0, dash));
+        uint to = dash == std::string::npos ? from : std::stoul(item.substr(dash + 1));
+
+        for (uint i = from; i <= to; ++ i)
+            res.push_back(i);
+    }
+
+    return res;
+}
+
+
+inline std::string read_sys_file(const std::string & file_name) {
+    std::ifstream in(file_name);
+    std::string res;
+
+    std::getline(in, res);
+
+    return res;
+}
+
+
+// Online nodes, single node 0 on systems without numa
+inline std::vector<uint> numa_nodes() {
+    auto nodes = parse_numa_list(read_sys_file("/sys/devices/system/node/online"));
+
+    if (nodes.empty())
+        nodes.push_back(0);
+
+    return nodes;
+}
+
+
+// Cpus of numa node, all online cpus on systems without numa
+inline std::vector<uint> numa_node_cpus(uint node) {
+    auto cpus = parse_numa_list(read_sys_file(std::string("/sys/devices/system/node/node") + std::to_string(node) + "/cpulist"));
+
+    if (cpus.empty())
+        cpus = parse_numa_list(read_sys_file("/sys/devices/system/cpu/online"));
+
+    return cpus;
+}
+
+
+// Memory policy of calling thread, applies to pages it touches first
+
+inline void numa_set_policy(int mode, const std::vector<uint> & nodes) {
+    const uint max_node = 1024;
+    unsigned long mask[max_node / (8 * sizeof(unsigned long))] = {};
+
+    for (auto n = nodes.begin(); n != nodes.end(); ++ n)
+        mask[*n / (8 * sizeof(unsigned long))] |= 1ul << (*n % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_set_mempolicy, mode, nodes.empty() ? nullptr : mask, nodes.empty() ? 0 : max_node) != 0)
+        throw std::runtime_error("Can't set numa memory policy");
+
+    parallel_first_touch() = mode == MPOL_DEFAULT;
+}
+
+inline void numa_set_interleave() {
+    numa_set_policy(MPOL_INTERLEAVE, numa_nodes());
+}
+
+inline void numa_set_bind(uint node) {
+    numa_set_policy(MPOL_BIND, std::vector<uint>(1, node));
+}
+
+inline void numa_set_default() {
+    numa_set_policy(MPOL_DEFAULT, std::vector<uint>());
+}
+
+
+// Position of node of current thread in numa_nodes(), set by numa_pin_threads
+inline uint & numa_thread_node() {
+    static thread_local uint node = 0;
+    return node;
+}
+
+
+// Pin OpenMP threads to cpus, spreading them round-robin over numa nodes
+inline void numa_pin_threads() {
+    auto nodes = numa_nodes();
+
+    std::vector<std::vector<uint>> node_cpus;
+    for (auto n = nodes.begin(); n != nodes.end(); ++ n)
+        node_cpus.push_back(numa_node_cpus(*n));
+
+    #pragma omp parallel
+    {
+        uint thread = omp_get_thread_num();
+        uint node = thread % nodes.size();
+
+        auto & cpus = node_cpus[node];
+
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpus[(thread / nodes.size()) % cpus.size()], &cpu_set);
+
+        sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+
+        numa_thread_node() = node;
+    }
+}
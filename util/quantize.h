@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include <immintrin.h>
+
+
+// Symmetric int8 quantization of vector with single scale, values are in [-127, 127] so that abs fits into int8
+inline void quantize_int8(const float * values, uint32_t n, float scale, int8_t * res) {
+    float inv_scale = scale > 0 ? 1 / scale : 0;
+
+    for (uint32_t i = 0; i < n; ++ i)
+        res[i] = (int8_t) std::max(-127.0f, std::min(127.0f, std::nearbyint(values[i] * inv_scale)));
+}
+
+
+// Chunk of 16 bytes of 16-byte aligned row starting at byte c, with padding after first n bytes zeroed, so only values are multiplied
+inline __m128i load_int8_chunk(const int8_t * p, uint32_t c, uint32_t n) {
+    __m128i x = _mm_load_si128((const __m128i *)(p + c));
+
+    if (c + 16 > n)
+        x = _mm_and_si128(x, _mm_cmpgt_epi8(_mm_set1_epi8(n - c), _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+
+    return x;
+}
+
+
+inline int32_t sum_int32(__m128i acc) {
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+
+    return _mm_cvtsi128_si32(acc);
+}
+
+
+// Partial dot products of 16 int8 pairs in 4 int32 lanes
+inline __m128i dot_int8(__m128i a, __m128i b) {
+    // Unsigned by signed multiplication, so sign of a is moved to b. Pair sums can't saturate, as abs values are at most 127
+    return _mm_madd_epi16(_mm_maddubs_epi16(_mm_abs_epi8(a), _mm_sign_epi8(b, a)), _mm_set1_epi16(1));
+}
+
+
+// Dot products of rows by vnni instructions, which multiply and accumulate quads of int8 pairs at once. They are not part
+// of x86-64-v3 and v4 levels kernels are built for, so these functions are compiled for their own targets and chosen at runtime
+__attribute__((target("avx512vnni,avx512vl")))
+inline int32_t dot_int8_avx512vnni(const int8_t * a, const int8_t * b, uint32_t n) {
+    __m128i acc = _mm_setzero_si128();
+
+    for (uint32_t c = 0; c < n; c += 16) {
+        __m128i xa = load_int8_chunk(a, c, n);
+        __m128i xb = load_int8_chunk(b, c, n);
+
+        acc = _mm_dpbusd_epi32(acc, _mm_abs_epi8(xa), _mm_sign_epi8(xb, xa));
+    }
+
+    return sum_int32(acc);
+}
+
+__attribute__((target("avxvnni")))
+inline int32_t dot_int8_avxvnni(const int8_t * a, const int8_t * b, uint32_t n) {
+    __m128i acc = _mm_setzero_si128();
+
+    for (uint32_t c = 0; c < n; c += 16) {
+        __m128i xa = load_int8_chunk(a, c, n);
+        __m128i xb = load_int8_chunk(b, c, n);
+
+        acc = _mm_dpbusd_avx_epi32(acc, _mm_abs_epi8(xa), _mm_sign_epi8(xb, xa));
+    }
+
+    return sum_int32(acc);
+}
+
+
+inline int32_t dot_int8_base(const int8_t * a, const int8_t * b, uint32_t n) {
+    __m128i acc = _mm_setzero_si128();
+
+    for (uint32_t c = 0; c < n; c += 16)
+        acc = _mm_add_epi32(acc, dot_int8(load_int8_chunk(a, c, n), load_int8_chunk(b, c, n)));
+
+    return sum_int32(acc);
+}
+
+
+enum class int8_dot_isa { base, avxvnni, avx512vnni };
+
+inline int8_dot_isa detect_int8_dot_isa() {
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl"))
+        return int8_dot_isa::avx512vnni;
+
+    if (__builtin_cpu_supports("avxvnni"))
+        return int8_dot_isa::avxvnni;
+
+    return int8_dot_isa::base;
+}
+
+
+// Dot product of first n int8 values of 16-byte aligned rows, which are padded to multiple of 16 bytes
+inline int32_t dot_int8(const int8_t * a, const int8_t * b, uint32_t n) {
+    static const int8_dot_isa isa = detect_int8_dot_isa();
+
+    switch (isa) {
+    case int8_dot_isa::avx512vnni:
+        return dot_int8_avx512vnni(a, b, n);
+    case int8_dot_isa::avxvnni:
+        return dot_int8_avxvnni(a, b, n);
+    default:
+        return dot_int8_base(a, b, n);
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+
+// Mix two values into well-distributed 64-bit seed (splitmix64 finalizer)
+inline uint64_t mix_seed(uint64_t a, uint64_t b) {
+    uint64_t z = a * 0x9e3779b97f4a7c15ull + b + 0x632be59bd9b4e019ull;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+
+// Four interleaved xoshiro256++ generators, produce 4 random 64-bit words per step. With avx2 each state word
+// of all generators is stepped as single generic vector, so it's held in one register in avx2 and avx512 kernel objects.
+// Baseline code has no 64-bit rotations and only half-width vectors, so there generators are stepped one by one
+class xoshiro256x4 {
+    alignas(32) uint64_t s[4][4]; // State words of each generator
+public:
+    explicit xoshiro256x4(uint64_t seed) {
+        for (uint i = 0; i < 16; ++ i)
+            s[i / 4][i % 4] = mix_seed(seed, i);
+    }
+
+    void next(uint64_t * res) {
+#ifdef __AVX2__
+        typedef uint64_t u64x4 __attribute__((vector_size(32)));
+
+        u64x4 s0, s1, s2, s3;
+
+        memcpy(&s0, s[0], sizeof(s0));
+        memcpy(&s1, s[1], sizeof(s1));
+        memcpy(&s2, s[2], sizeof(s2));
+        memcpy(&s3, s[3], sizeof(s3));
+
+        u64x4 sum = s0 + s3;
+        u64x4 r = ((sum << 23) | (sum >> 41)) + s0;
+        u64x4 t = s1 << 17;
+
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = (s3 << 45) | (s3 >> 19);
+
+        memcpy(s[0], &s0, sizeof(s0));
+        memcpy(s[1], &s1, sizeof(s1));
+        memcpy(s[2], &s2, sizeof(s2));
+        memcpy(s[3], &s3, sizeof(s3));
+
+        memcpy(res, &r, sizeof(r));
+#else
+        for (uint j = 0; j < 4; ++ j) {
+            uint64_t t = s[1][j] << 17;
+
+            res[j] = rotl(s[0][j] + s[3][j], 23) + s[0][j];
+
+            s[2][j] ^= s[0][j];
+            s[3][j] ^= s[1][j];
+            s[1][j] ^= s[2][j];
+            s[0][j] ^= s[3][j];
+            s[2][j] ^= t;
+            s[3][j] = rotl(s[3][j], 45);
+        }
+#endif
+    }
+private:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+
+// Scalar xoshiro256++ generator, usable with standard algorithms like std::shuffle
+class xoshiro256 {
+    uint64_t s[4];
+public:
+    typedef uint64_t result_type;
+
+    explicit xoshiro256(uint64_t seed) {
+        for (uint i = 0; i < 4; ++ i)
+            s[i] = mix_seed(seed, i);
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator()() {
+        uint64_t res = rotl(s[0] + s[3], 23) + s[0];
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return res;
+    }
+private:
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+
+// Counter-based random values, depend only on seed and counter, so may be generated in any order
+
+inline float counter_uniform(uint64_t seed, uint64_t counter, float min, float max) {
+    float u = (mix_seed(seed, counter) >> 40) * (1.0f / (1 << 24)); // 24 random bits in [0, 1)
+    return min + u * (max - min);
+}
+
+inline float counter_normal(uint64_t seed, uint64_t counter, float mean, float stddev) {
+    uint64_t r = mix_seed(seed, counter);
+
+    // Box-Muller transform of two 32-bit uniforms, first one in (0, 1]
+    float u1 = ((r >> 32) + 1.0f) * (1.0f / 4294967296.0f);
+    float u2 = (r & 0xffffffffull) * (1.0f / 4294967296.0f);
+
+    return mean + stddev * sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+}
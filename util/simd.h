@@ -0,0 +1,326 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#include <immintrin.h>
+
+#include "half.h"
+#include "random.h"
+#include "quantize.h"
+
+
+// Instruction sets of model kernels. Kernels are compiled for each of them in separate objects (see Makefile),
+// best one supported by cpu is used unless lower one is requested
+enum class simd_isa { scalar, avx2, avx512 };
+
+
+inline simd_isa detect_simd_isa() {
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("x86-64-v4"))
+        return simd_isa::avx512;
+
+    if (__builtin_cpu_supports("x86-64-v3"))
+        return simd_isa::avx2;
+
+    return simd_isa::scalar;
+}
+
+
+// Instruction set of kernels used by models
+inline simd_isa & simd_kernels() {
+    static simd_isa isa = detect_simd_isa();
+    return isa;
+}
+
+
+inline const char * simd_isa_name(simd_isa isa) {
+    switch (isa) {
+    case simd_isa::avx512:
+        return "avx512";
+    case simd_isa::avx2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+
+// Vector operations used by kernels, one struct per instruction set.
+//
+// Kernels process rows in blocks of width elements, using operators of vector extensions for arithmetic.
+// Multiply-adds are written with fmadd and fnmadd, kernel objects are compiled without implicit contraction,
+// so rounding of kernels depends only on instruction set and not on code shape.
+// Loads and stores take number of leading lanes n of block, other lanes are zero on load and kept in memory on store.
+// Stochastic rounding stores take random bits from generator.
+
+struct simd_scalar {
+    typedef float vec;
+
+    static constexpr uint width = 1;
+
+    // Number of row elements processed for n leading ones, rows are zero-padded to multiple of 8
+    static constexpr uint span(uint n) { return n; }
+
+    static vec zero() { return 0; }
+    static vec set1(float v) { return v; }
+
+    static vec load(const float * p, uint = width) { return *p; }
+    static vec load_fp16(const uint16_t * p, uint = width) { return fp16_to_float(*p); }
+    static vec load_bf16(const uint16_t * p, uint = width) { return bf16_to_float(*p); }
+
+    static vec gather(const float * base, const uint32_t * idx, uint = width) { return base[*idx]; }
+
+    static void store(float * p, vec v, uint = width) { *p = v; }
+    static void store_fp16_stochastic(uint16_t * p, vec v, xoshiro256x4 & gen, uint = width) { *p = float_to_fp16_stochastic(v, random_bits(gen)); }
+    static void store_bf16_stochastic(uint16_t * p, vec v, xoshiro256x4 & gen, uint = width) { *p = float_to_bf16_stochastic(v, random_bits(gen)); }
+
+    static vec sqrt(vec v) { return sqrtf(v); }
+    static vec rsqrt(vec v) { return 1 / sqrtf(v); }
+
+    // Fused a * b + c and c - a * b, baseline has no fma so they are separate operations here
+    static vec fmadd(vec a, vec b, vec c) { return a * b + c; }
+    static vec fnmadd(vec a, vec b, vec c) { return c - a * b; }
+
+    static float sum(vec v) { return v; }
+
+    // Sum of lanes in every lane, to use it in vector operations without round trip through scalar
+    static vec sum_all(vec v) { return v; }
+
+    // Value of lane i in every lane
+    static vec broadcast_lane(vec v, uint) { return v; }
+
+    // Zero lanes of block starting at element offset which are at element n or after it
+    static vec mask_below(vec v, uint n, uint offset) { return offset < n ? v : 0; }
+
+    // Replace lane of element n in block starting at element offset by same lane of x
+    static vec set_lane(vec v, vec x, uint n, uint offset) { return offset == n ? x : v; }
+
+    static float fp16_to_float(uint16_t v) { return ::fp16_to_float(v); }
+
+    static int32_t dot_int8(const int8_t * a, const int8_t * b, uint n) {
+        int32_t res = 0;
+
+        for (uint i = 0; i < n; ++ i)
+            res += int32_t(a[i]) * int32_t(b[i]);
+
+        return res;
+    }
+private:
+    static uint32_t random_bits(xoshiro256x4 & gen) {
+        uint64_t rnd[4];
+        gen.next(rnd);
+
+        return rnd[0];
+    }
+};
+
+
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+
+struct simd_avx2 {
+    typedef __m256 vec;
+
+    static constexpr uint width = 8;
+
+    // Padding is processed too, as it's cheaper than masking
+    static constexpr uint span(uint n) { return (n + width - 1) / width * width; }
+
+    static vec zero() { return _mm256_setzero_ps(); }
+    static vec set1(float v) { return _mm256_set1_ps(v); }
+
+    // Partial blocks are used only by unpadded fp32 arrays, padded rows always have full ones
+    static vec load(const float * p, uint n = width) { return n < width ? _mm256_maskload_ps(p, lane_mask(n)) : _mm256_load_ps(p); }
+    static vec load_fp16(const uint16_t * p, uint = width) { return _mm256_cvtph_ps(_mm_load_si128((const __m128i *) p)); }
+    static vec load_bf16(const uint16_t * p, uint = width) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_load_si128((const __m128i *) p)), 16)); }
+
+    static vec gather(const float * base, const uint32_t * idx, uint n = width) {
+        __m256i mask = lane_mask(n);
+        return _mm256_mask_i32gather_ps(zero(), base, _mm256_maskload_epi32((const int *) idx, mask), _mm256_castsi256_ps(mask), 4);
+    }
+
+    static void store(float * p, vec v, uint n = width) {
+        if (n < width)
+            _mm256_maskstore_ps(p, lane_mask(n), v);
+        else
+            _mm256_store_ps(p, v);
+    }
+
+    static void store_fp16_stochastic(uint16_t * p, vec v, xoshiro256x4 & gen, uint = width) {
+        __m256i bits = _mm256_add_epi32(_mm256_castps_si256(v), _mm256_and_si256(random_bits(gen), _mm256_set1_epi32(0x1fff)));
+
+        _mm_store_si128((__m128i *) p, _mm256_cvtps_ph(_mm256_castsi256_ps(bits), _MM_FROUND_TO_ZERO));
+    }
+
+    static void store_bf16_stochastic(uint16_t * p, vec v, xoshiro256x4 & gen, uint = width) {
+        __m256i bits = _mm256_add_epi32(_mm256_castps_si256(v), _mm256_and_si256(random_bits(gen), _mm256_set1_epi32(0xffff)));
+
+        bits = _mm256_srli_epi32(bits, 16);
+        bits = _mm256_permute4x64_epi64(_mm256_packus_epi32(bits, bits), 0x08); // Gather packed halves of both lanes in low 128 bits
+
+        _mm_store_si128((__m128i *) p, _mm256_castsi256_si128(bits));
+    }
+
+    static vec sqrt(vec v) { return _mm256_sqrt_ps(v); }
+    static vec rsqrt(vec v) { return _mm256_rsqrt_ps(v); }
+
+    static vec fmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+    static vec fnmadd(vec a, vec b, vec c) { return _mm256_fnmadd_ps(a, b, c); }
+
+    static float sum(vec v) {
+        __m128 s = _mm256_extractf128_ps(_mm256_add_ps(v, _mm256_permute2f128_ps(v, v, 1)), 0);
+
+        s = _mm_hadd_ps(s, s);
+        s = _mm_hadd_ps(s, s);
+
+        return _mm_cvtss_f32(s);
+    }
+
+    static vec sum_all(vec v) {
+        vec s = _mm256_add_ps(v, _mm256_permute2f128_ps(v, v, 1));
+
+        s = _mm256_add_ps(s, _mm256_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+        s = _mm256_add_ps(s, _mm256_shuffle_ps(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        return s;
+    }
+
+    static vec broadcast_lane(vec v, uint i) { return _mm256_permutevar8x32_ps(v, _mm256_set1_epi32(i)); }
+
+    static vec mask_below(vec v, uint n, uint offset) {
+        return _mm256_and_ps(v, _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n - offset), lane_index())));
+    }
+
+    static vec set_lane(vec v, vec x, uint n, uint offset) {
+        return _mm256_blendv_ps(v, x, _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_set1_epi32(n - offset), lane_index())));
+    }
+
+    static float fp16_to_float(uint16_t v) { return _cvtsh_ss(v); }
+
+    static int32_t dot_int8(const int8_t * a, const int8_t * b, uint n) { return ::dot_int8(a, b, n); }
+private:
+    static __m256i lane_index() { return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7); }
+    static __m256i lane_mask(uint n) { return _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane_index()); }
+
+    static __m256i random_bits(xoshiro256x4 & gen) {
+        uint64_t rnd[4];
+        gen.next(rnd);
+
+        return _mm256_loadu_si256((const __m256i *) rnd);
+    }
+};
+
+#else
+struct simd_avx2;
+#endif
+
+
+#if defined(__AVX512F__) && defined(__AVX512BW__) && defined(__AVX512VL__)
+
+struct simd_avx512 {
+    typedef __m512 vec;
+
+    static constexpr uint width = 16;
+
+    // Tails are masked, so padding isn't touched
+    static constexpr uint span(uint n) { return n; }
+
+    static vec zero() { return _mm512_setzero_ps(); }
+    static vec set1(float v) { return _mm512_set1_ps(v); }
+
+    // Rows are aligned only to 32 bytes, so unaligned loads and stores are used
+    static vec load(const float * p, uint n = width) { return _mm512_maskz_loadu_ps(lane_mask(n), p); }
+    static vec load_fp16(const uint16_t * p, uint n = width) { return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(lane_mask(n), p)); }
+    static vec load_bf16(const uint16_t * p, uint n = width) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(lane_mask(n), p)), 16)); }
+
+    static vec gather(const float * base, const uint32_t * idx, uint n = width) {
+        __mmask16 mask = lane_mask(n);
+        return _mm512_mask_i32gather_ps(zero(), mask, _mm512_maskz_loadu_epi32(mask, idx), base, 4);
+    }
+
+    static void store(float * p, vec v, uint n = width) { _mm512_mask_storeu_ps(p, lane_mask(n), v); }
+
+    static void store_fp16_stochastic(uint16_t * p, vec v, xoshiro256x4 & gen, uint n = width) {
+        __m512i bits = _mm512_add_epi32(_mm512_castps_si512(v), _mm512_and_si512(random_bits(gen), _mm512_set1_epi32(0x1fff)));
+
+        _mm256_mask_storeu_epi16(p, lane_mask(n), _mm512_cvtps_ph(_mm512_castsi512_ps(bits), _MM_FROUND_TO_ZERO));
+    }
+
+    static void store_bf16_stochastic(uint16_t * p, vec v, xoshiro256x4 & gen, uint n = width) {
+        __m512i bits = _mm512_add_epi32(_mm512_castps_si512(v), _mm512_and_si512(random_bits(gen), _mm512_set1_epi32(0xffff)));
+
+        _mm256_mask_storeu_epi16(p, lane_mask(n), _mm512_cvtepi32_epi16(_mm512_srli_epi32(bits, 16)));
+    }
+
+    static vec sqrt(vec v) { return _mm512_sqrt_ps(v); }
+    static vec rsqrt(vec v) { return _mm512_rsqrt14_ps(v); }
+
+    static vec fmadd(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+    static vec fnmadd(vec a, vec b, vec c) { return _mm512_fnmadd_ps(a, b, c); }
+
+    static float sum(vec v) { return _mm512_reduce_add_ps(v); }
+
+    static vec sum_all(vec v) {
+        vec s = _mm512_add_ps(v, _mm512_shuffle_f32x4(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        s = _mm512_add_ps(s, _mm512_shuffle_f32x4(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+        s = _mm512_add_ps(s, _mm512_permute_ps(s, _MM_SHUFFLE(1, 0, 3, 2)));
+        s = _mm512_add_ps(s, _mm512_permute_ps(s, _MM_SHUFFLE(2, 3, 0, 1)));
+
+        return s;
+    }
+
+    static vec broadcast_lane(vec v, uint i) { return _mm512_permutexvar_ps(_mm512_set1_epi32(i), v); }
+
+    static vec mask_below(vec v, uint n, uint offset) { return _mm512_maskz_mov_ps(n > offset ? lane_mask(n - offset) : 0, v); }
+
+    static vec set_lane(vec v, vec x, uint n, uint offset) {
+        return n >= offset && n - offset < width ? _mm512_mask_mov_ps(v, __mmask16(1u << (n - offset)), x) : v;
+    }
+
+    static float fp16_to_float(uint16_t v) { return _cvtsh_ss(v); }
+
+    static int32_t dot_int8(const int8_t * a, const int8_t * b, uint n) { return ::dot_int8(a, b, n); }
+private:
+    static __mmask16 lane_mask(uint n) { return n < width ? __mmask16((1u << n) - 1) : __mmask16(0xffff); }
+
+    static __m512i random_bits(xoshiro256x4 & gen) {
+        uint64_t rnd[8];
+        gen.next(rnd);
+        gen.next(rnd + 4);
+
+        return _mm512_loadu_si512(rnd);
+    }
+};
+
+#else
+struct simd_avx512;
+#endif
+
+
+// Number of lanes of block starting at element offset in span of given length
+template <typename V>
+constexpr uint simd_lanes(uint offset, uint length) {
+    return length - offset < V::width ? length - offset : V::width;
+}
+
+
+// Kernel instruction set as template tag argument, type is incomplete outside of its kernel objects
+template <typename V>
+struct simd_tag {
+    typedef V type;
+};
+
+// Call f with tag of instruction set of model kernels
+template <typename F>
+inline auto dispatch_simd(F f) -> decltype(f(simd_tag<simd_scalar>())) {
+    switch (simd_kernels()) {
+    case simd_isa::avx512:
+        return f(simd_tag<simd_avx512>());
+    case simd_isa::avx2:
+        return f(simd_tag<simd_avx2>());
+    default:
+        return f(simd_tag<simd_scalar>());
+    }
+}
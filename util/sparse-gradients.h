@@ -0,0 +1,143 @@
+#pragma once
+
+#include "model-helpers.h"
+#include "alloc.h"
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+
+// Gradients of weight rows touched by thread in mini-batch, accumulated by row key together with number of hits,
+// so each row gets single update when mini-batch ends. Rows are aligned float arrays of the same size,
+// found by open-addressing hash table with linear probing, which is kept at most half full.
+class sparse_gradients {
+    static constexpr uint64_t empty_key = ~uint64_t(0);
+
+    uint row_stride; // In floats, aligned
+    uint n_rows, row_capacity;
+
+    float * rows;
+
+    std::vector<uint64_t> row_keys;
+    std::vector<uint> row_hits;
+    std::vector<uint> row_slots; // Table slot of each row, to clear only used ones
+
+    std::vector<uint64_t> table_keys;
+    std::vector<uint> table_rows;
+    uint table_mask;
+public:
+    sparse_gradients(): row_stride(0), n_rows(0), row_capacity(0), rows(nullptr), table_keys(1024, empty_key), table_rows(1024), table_mask(1023) {}
+
+    ~sparse_gradients() {
+        if (rows != nullptr)
+            free_aligned(rows);
+    }
+
+    // Forget all rows, next ones will have given size
+    void clear(uint row_size) {
+        for (uint i = 0; i < n_rows; ++ i)
+            table_keys[row_slots[i]] = empty_key;
+
+        n_rows = 0;
+
+        row_keys.clear();
+        row_hits.clear();
+        row_slots.clear();
+
+        if (aligned_float_array_size(row_size) != row_stride) {
+            if (rows != nullptr)
+                free_aligned(rows);
+
+            row_stride = aligned_float_array_size(row_size);
+            row_capacity = 0;
+            rows = nullptr;
+        }
+    }
+
+    // Gradient of row with given key, zero when it's first touched. Counts hit of row
+    float * row(uint64_t key) {
+        uint slot = hash(key) & table_mask;
+
+        while (table_keys[slot] != key) {
+            if (table_keys[slot] == empty_key)
+                return insert(key, slot);
+
+            slot = (slot + 1) & table_mask;
+        }
+
+        uint i = table_rows[slot];
+
+        row_hits[i] ++;
+
+        return rows + size_t(i) * row_stride;
+    }
+
+    uint size() const { return n_rows; }
+
+    uint64_t key(uint i) const { return row_keys[i]; }
+    uint hits(uint i) const { return row_hits[i]; }
+    float * data(uint i) { return rows + size_t(i) * row_stride; }
+private:
+    static uint64_t hash(uint64_t key) {
+        return (key * 0x9E3779B97F4A7C15ull) >> 32;
+    }
+
+    float * insert(uint64_t key, uint slot) {
+        if (n_rows == row_capacity)
+            grow_rows();
+
+        if (2 * (n_rows + 1) > table_keys.size()) {
+            grow_table();
+            return row(key);
+        }
+
+        uint i = n_rows ++;
+
+        table_keys[slot] = key;
+        table_rows[slot] = i;
+
+        row_keys.push_back(key);
+        row_hits.push_back(1);
+        row_slots.push_back(slot);
+
+        float * r = rows + size_t(i) * row_stride;
+
+        memset(r, 0, row_stride * sizeof(float));
+
+        return r;
+    }
+
+    void grow_rows() {
+        uint new_capacity = row_capacity > 0 ? row_capacity * 2 : 1024;
+        float * new_rows = malloc_aligned<float>(size_t(new_capacity) * row_stride);
+
+        if (rows != nullptr) {
+            memcpy(new_rows, rows, size_t(n_rows) * row_stride * sizeof(float));
+            free_aligned(rows);
+        }
+
+        rows = new_rows;
+        row_capacity = new_capacity;
+    }
+
+    // Double table and reinsert existing rows
+    void grow_table() {
+        uint new_size = table_keys.size() * 2;
+
+        table_keys.assign(new_size, empty_key);
+        table_rows.assign(new_size, 0);
+        table_mask = new_size - 1;
+
+        for (uint i = 0; i < n_rows; ++ i) {
+            uint slot = hash(row_keys[i]) & table_mask;
+
+            while (table_keys[slot] != empty_key)
+                slot = (slot + 1) & table_mask;
+
+            table_keys[slot] = row_keys[i];
+            table_rows[slot] = i;
+            row_slots[i] = slot;
+        }
+    }
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "model-helpers.h"
+#include "alloc.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include <omp.h>
+
+
+// Lock-free bounded queue of fixed-size float records between one producer and one consumer thread.
+// Positions only grow, record of position p is at p % capacity
+class spsc_queue {
+    // Positions written by different threads are padded to separate cache lines
+    std::atomic<uint64_t> head; // Next record to read, written by consumer
+    char head_padding[64 - sizeof(uint64_t)];
+
+    std::atomic<uint64_t> tail; // Next record to write, written by producer
+    uint64_t free_until; // Producer's bound of free records, refreshed from head when reached
+    char tail_padding[64 - 2 * sizeof(uint64_t)];
+
+    float * records;
+    uint record_size; // In floats, aligned
+    uint capacity; // Power of two
+public:
+    spsc_queue(uint record_size, uint capacity): head(0), tail(0), free_until(capacity), record_size(record_size), capacity(capacity) {
+        records = malloc_aligned<float>(size_t(record_size) * capacity);
+    }
+
+    ~spsc_queue() {
+        free_aligned(records);
+    }
+
+    // Record to fill by producer, or nullptr if queue is full
+    float * reserve() {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+
+        if (t == free_until) {
+            free_until = head.load(std::memory_order_acquire) + capacity;
+
+            if (t == free_until)
+                return nullptr;
+        }
+
+        return records + size_t(t & (capacity - 1)) * record_size;
+    }
+
+    // Publish reserved record to consumer
+    void commit() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Call f with each published record, then free them for producer
+    template <typename F>
+    void drain(F f) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t t = tail.load(std::memory_order_acquire);
+
+        if (h == t)
+            return;
+
+        for (uint64_t p = h; p != t; ++ p)
+            f(records + size_t(p & (capacity - 1)) * record_size);
+
+        head.store(t, std::memory_order_release);
+    }
+};
+
+
+// Owner-computes routing of row updates: rows are partitioned by feature index between training threads,
+// and updates of rows owned by other thread are sent to it by queue of each (sender, owner) pair, so only owner writes them.
+// Record is header block with row key and number of hits, followed by aligned row gradient
+class update_shards {
+    uint n_shards;
+    uint index_bits;
+    uint row_size; // In floats, aligned
+
+    std::vector<spsc_queue *> queues; // Queue from thread s to thread o is at s * n_shards + o
+
+    std::atomic<uint64_t> finished; // Number of thread passes which finished sending, grows by n_shards per pass
+public:
+    static constexpr uint header_size = align_floats;
+
+    // Records queued by each sender to all owners, enough for rows of usual mini-batch, so owners draining
+    // their queues after each mini-batch rarely make senders wait
+    static constexpr uint sender_capacity = 16384;
+
+    update_shards(uint index_bits, uint row_size): n_shards(omp_get_max_threads()), index_bits(index_bits), row_size(aligned_float_array_size(row_size)), finished(0) {
+        uint capacity = 256;
+
+        while (capacity * n_shards < sender_capacity)
+            capacity *= 2;
+
+        for (uint i = 0; i < n_shards * n_shards; ++ i)
+            queues.push_back(new spsc_queue(header_size + this->row_size, capacity));
+    }
+
+    ~update_shards() {
+        for (auto q = queues.begin(); q != queues.end(); ++ q)
+            delete *q;
+    }
+
+    // Thread owning rows of feature index, contiguous ranges of hash space
+    uint owner(uint64_t index) const {
+        return (index * n_shards) >> index_bits;
+    }
+
+    uint size() const { return n_shards; }
+
+    // Queue aligned gradient row to owner thread, while its queue is full apply records sent to sender
+    // by receive_own(), so threads waiting for each other still make progress
+    template <typename F>
+    void send(uint sender, uint owner, uint64_t key, uint hits, const float * grad, F receive_own) {
+        spsc_queue & q = *queues[sender * n_shards + owner];
+        float * rec;
+
+        while ((rec = q.reserve()) == nullptr) {
+            receive_own();
+            std::this_thread::yield();
+        }
+
+        memcpy(rec, &key, sizeof(key));
+        memcpy(rec + 2, &hits, sizeof(hits));
+        memcpy(rec + header_size, grad, row_size * sizeof(float)); // With zero padding, as kernels use whole vectors
+
+        q.commit();
+    }
+
+    // Called by each of n_shards threads when it has nothing more to send in pass: applies records sent to it
+    // by receive_own() until all threads finish, as they may still wait for its queues
+    template <typename F>
+    void finish(F receive_own) {
+        uint64_t done = ++ finished;
+        uint64_t pass_end = (done + n_shards - 1) / n_shards * n_shards;
+
+        while (finished.load(std::memory_order_acquire) < pass_end) {
+            receive_own();
+            std::this_thread::yield();
+        }
+
+        receive_own();
+    }
+
+    // Call f(key, hits, grad) with records sent to owner thread
+    template <typename F>
+    void receive(uint owner, F f) {
+        for (uint s = 0; s < n_shards; ++ s) {
+            queues[s * n_shards + owner]->drain([&](const float * rec) {
+                uint64_t key;
+                uint hits;
+
+                memcpy(&key, rec, sizeof(key));
+                memcpy(&hits, rec + 2, sizeof(hits));
+
+                f(key, hits, rec + header_size);
+            });
+        }
+    }
+};